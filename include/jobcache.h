@@ -0,0 +1,27 @@
+/*
+	ptouch-print - Print labels with images or text on a Brother P-Touch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#define JOBCACHE_SIZE	64	/* default limit in MiB */
+#define JOBCACHE_SEED	UINT64_C(14695981039346656037)	/* start value for jobcache_hash() */
+
+/* jobcache.c */
+int jobcache_open(const char *dir, size_t limit);
+uint64_t jobcache_hash(uint64_t h, const void *data, size_t len);
+uint64_t jobcache_hash_file(uint64_t h, const char *file);
+int jobcache_get(uint64_t key, const uint8_t **data, size_t *len);
+void jobcache_release(const uint8_t *data, size_t len);
+int jobcache_put(uint64_t key, const uint8_t *data, size_t len);
@@ -17,7 +17,12 @@
 	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#ifndef PTOUCH_H
+#define PTOUCH_H
+
 #include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 
 struct _pt_tape_info {
@@ -30,6 +35,19 @@ struct _pt_tape_info {
 #define FLAG_RASTER_PACKBITS	(1 << 1)
 #define FLAG_PLITE		(1 << 2)
 #define FLAG_P700_INIT		(1 << 3)
+#define FLAG_RASTER_EMPTY	(1 << 4)	/* knows 0x5a for an empty raster line */
+
+/* size of one bulk transfer in multiples of the OUT endpoint packet size */
+#define PTOUCH_TX_PACKETS	64
+/* default number of bulk transfers kept in flight */
+#define PTOUCH_QUEUE_DEPTH	4
+/* default time in ms a printer has to answer a status request */
+#define PTOUCH_STATUS_TIMEOUT	1000
+
+/* worst case size of n bytes after PackBits compression */
+#define PACKBITS_MAX_LEN(n)	((n) + (((n) + 127) / 128))
+/* longest command ptouch_raster_command() makes of a line of n bytes */
+#define PTOUCH_RASTER_CMD_MAX(n)	(3 + PACKBITS_MAX_LEN(n))
 
 typedef enum _pt_page_flags{
 	FEED_NONE	= 0x0,
@@ -80,18 +98,108 @@ struct __attribute__((packed, aligned(4))) _ptouch_stat {
 };
 typedef struct _ptouch_stat *pt_dev_stat;
 
+struct _pt_xfer_stats {
+	unsigned long submitted;	/* bulk OUT transfers submitted */
+	unsigned long completed;
+	int max_inflight;	/* highest number of transfers queued at once */
+	size_t bytes;		/* bytes that went over the wire */
+	unsigned long commands;	/* ptouch_send() calls */
+	double latency_sum;	/* seconds from submit to completion, summed */
+	double latency_min;
+	double latency_max;
+};
+
+struct _ptouch_dev;
+
+/* how bytes get to the printer and back. write() is handed the buffer
+   filled by ptouch_send(), read() returns the number of bytes read, 0
+   if nothing came within timeout_ms, or -1 on errors. */
+struct _pt_transport_ops {
+	int (*write)(struct _ptouch_dev *ptdev, uint8_t *data, size_t len);
+	int (*read)(struct _ptouch_dev *ptdev, uint8_t *buf, size_t len, unsigned int timeout_ms);
+	void (*close)(struct _ptouch_dev *ptdev);
+};
+
+struct _pt_xfer {
+	struct _ptouch_dev *ptdev;
+	struct libusb_transfer *t;
+	uint8_t *buf;
+	int busy;		/* submitted and not yet completed */
+	struct timespec submitted;
+};
+
 struct _ptouch_dev {
+	const struct _pt_transport_ops *ops;
+	void *tp;		/* state of a transport other than USB */
+	libusb_context *ctx;	/* each printer has its own, unless hotplugged */
+	struct _pt_hotplug *hp;	/* whose context it shares, NULL if none */
 	libusb_device_handle *h;
+	int bus;		/* where it is plugged in */
+	int addr;
 	pt_dev_info devinfo;
 	pt_dev_stat status;
 	uint16_t tape_width_px;
+	uint8_t ep_out;		/* bulk OUT endpoint */
+	uint8_t ep_in;		/* bulk IN endpoint */
+	size_t max_packet;	/* wMaxPacketSize of ep_out */
+	uint8_t *txbuf;		/* buffer of the slot currently being filled */
+	size_t txlen;
+	size_t txsize;
+	struct _pt_xfer *xfers;	/* ring of transfer slots */
+	int nxfers;		/* queue depth */
+	int cur;		/* slot being filled by ptouch_send() */
+	int inflight;
+	int tx_error;		/* set by a failed transfer */
+	unsigned int status_timeout;	/* ms to wait for a status reply */
+	struct libusb_transfer *mon;	/* status monitor reading ep_in */
+	uint8_t mon_buf[32];
+	int mon_active;		/* mon is submitted */
+	int mon_stop;		/* do not submit mon again */
+	int mon_error;		/* error bits from the last status, -1 for an error without bits */
+	struct _pt_xfer_stats xstats;
+	uint8_t *rec;		/* copy of everything sent, see ptouch_record_start() */
+	size_t rec_len;
+	size_t rec_size;
+	int recording;		/* 1 while recording, -1 if out of memory */
 };
 typedef struct _ptouch_dev *ptouch_dev;
 
+/* which printer to open, fields that are not set match any printer */
+struct _pt_selector {
+	int bus;		/* -1 for any */
+	int addr;		/* -1 for any */
+	uint8_t port[7];	/* port path from the root hub */
+	int nports;		/* 0 for any */
+	const char *serial;	/* iSerial string, NULL for any */
+};
+typedef struct _pt_selector *pt_selector;
+
+enum { PT_HOTPLUG_NONE, PT_HOTPLUG_ARRIVED, PT_HOTPLUG_LEFT };
+struct _pt_hotplug;
+typedef struct _pt_hotplug *pt_hotplug;
+
 int ptouch_open(ptouch_dev *ptdev);
+int ptouch_open_sel(ptouch_dev *ptdev, pt_selector sel);
+int ptouch_open_all(ptouch_dev **ptdevs);
+int ptouch_open_transport(ptouch_dev *ptdev, uint16_t pid, const struct _pt_transport_ops *ops, void *tp);
+int ptouch_parse_selector(const char *spec, pt_selector sel);
+pt_hotplug ptouch_hotplug_start(void);
+int ptouch_hotplug_wait(pt_hotplug hp, int timeout_ms, pt_selector where, ptouch_dev *ptdev);
+void ptouch_hotplug_stop(pt_hotplug hp);
 int ptouch_close(ptouch_dev ptdev);
 int ptouch_send(ptouch_dev ptdev, uint8_t *data, size_t len);
+int ptouch_flush(ptouch_dev ptdev);
+void ptouch_record_start(ptouch_dev ptdev);
+uint8_t *ptouch_record_stop(ptouch_dev ptdev, size_t *len);
+int ptouch_set_queue_depth(ptouch_dev ptdev, int n);
+int ptouch_get_queue_depth(ptouch_dev ptdev);
+void ptouch_set_status_timeout(ptouch_dev ptdev, unsigned int ms);
+int ptouch_monitor_start(ptouch_dev ptdev);
+int ptouch_monitor_stop(ptouch_dev ptdev);
+int ptouch_monitor_error(ptouch_dev ptdev);
+struct _pt_xfer_stats *ptouch_get_xfer_stats(ptouch_dev ptdev);
 int ptouch_init(ptouch_dev ptdev);
+int ptouch_reset(ptouch_dev ptdev);
 int ptouch_lf(ptouch_dev ptdev);
 int ptouch_ff(ptouch_dev ptdev);
 size_t ptouch_get_max_pixel_width(ptouch_dev ptdev);
@@ -101,4 +209,105 @@ int ptouch_eject(ptouch_dev ptdev);
 int ptouch_getstatus(ptouch_dev ptdev);
 int ptouch_enable_packbits(ptouch_dev ptdev);
 int ptouch_rasterstart(ptouch_dev ptdev);
+size_t ptouch_raster_command(ptouch_dev ptdev, const uint8_t *data, size_t len, uint8_t *cmd);
 int ptouch_sendraster(ptouch_dev ptdev, uint8_t *data, size_t len);
+size_t ptouch_packbits(const uint8_t *src, size_t len, uint8_t *dst);
+ssize_t ptouch_unpackbits(const uint8_t *src, size_t len, uint8_t *dst, size_t dstlen);
+size_t ptouch_encode_rasterline(const uint8_t *data, size_t len, uint8_t *dst);
+
+/* 1bpp bitmap stored column by column, like the raster lines sent to the
+   printer: bit i of column x (byte i/8, bit i%8 of data + x*stride) is
+   pixel (x, height-1-i), so the bottom row is bit 0 of every column.
+   Unused bits at the end of a column are always 0. */
+struct _pt_bitmap {
+	int width;		/* columns, the length along the tape */
+	int height;		/* pixels across the tape */
+	size_t stride;		/* bytes per column */
+	uint8_t *data;
+};
+typedef struct _pt_bitmap *pt_bitmap;
+
+/* threads rendering lazy segments, shared by all labels */
+struct _pt_render_pool;
+typedef struct _pt_render_pool *pt_render_pool;
+
+/* a label is a list of bitmaps placed next to each other along the tape */
+struct _pt_label_seg {
+	pt_bitmap bm;		/* NULL while a lazy segment is not rendered */
+	int x;			/* first column of the segment */
+	int height;
+	pt_bitmap (*render)(void *ctx);	/* set for lazy segments */
+	void *ctx;
+	int failed;		/* render() returned NULL */
+};
+
+struct _pt_label {
+	struct _pt_label_seg *seg;
+	int nseg;
+	int allocated;
+	int width;		/* sum of all segment widths */
+	int height;		/* height of the highest segment */
+	int cur;		/* segment of the last column looked up */
+	int lazy;		/* number of segments rendered on demand */
+	int stream_seg;		/* position of ptouch_label_next_rasterline() */
+	int stream_x;
+	pt_render_pool pool;	/* renders lazy segments, NULL if none */
+};
+typedef struct _pt_label *pt_label;
+
+/* raster.c */
+void ptouch_pack_8bpp(uint8_t *dst, const uint8_t *src, int width, uint8_t ink);
+void ptouch_transpose(uint8_t *cols, size_t stride, const uint8_t *const *rows, int x0, int width, int height, int offset);
+pt_bitmap ptouch_bitmap_new(int width, int height);
+void ptouch_bitmap_free(pt_bitmap bm);
+pt_bitmap ptouch_bitmap_from_rows(const uint8_t *const *rows, int width, int height);
+int ptouch_bitmap_get(pt_bitmap bm, int x, int y);
+void ptouch_bitmap_set(pt_bitmap bm, int x, int y, int v);
+void ptouch_bitmap_blit(pt_bitmap dst, int dx, int dy, pt_bitmap src);
+void ptouch_bitmap_or(pt_bitmap dst, int dx, int dy, pt_bitmap src);
+void ptouch_bitmap_fill(pt_bitmap bm, int x, int y, int w, int h, int v);
+void ptouch_bitmap_mirror(pt_bitmap bm);
+int ptouch_bitmap_rasterline(pt_bitmap bm, int x, uint8_t *line, size_t bpl, int offset);
+
+/* label.c */
+pt_label ptouch_label_new(void);
+void ptouch_label_free(pt_label l);
+int ptouch_label_append(pt_label l, pt_bitmap bm);
+int ptouch_label_append_lazy(pt_label l, int height, pt_bitmap (*render)(void *ctx), void *ctx);
+pt_render_pool ptouch_render_pool_new(int n);
+void ptouch_render_pool_free(pt_render_pool pool);
+void ptouch_label_set_pool(pt_label l, pt_render_pool pool);
+void ptouch_label_rewind(pt_label l);
+int ptouch_label_ready(pt_label l);
+int ptouch_label_next_rasterline(pt_label l, uint8_t *line, size_t bpl, int offset);
+int ptouch_label_rasterline(pt_label l, int x, uint8_t *line, size_t bpl, int offset);
+pt_bitmap ptouch_label_render(pt_label l);
+
+/* transport.c */
+int ptouch_open_capture(ptouch_dev *ptdev, uint16_t pid, int tape_mm, const char *file);
+int ptouch_open_replay(ptouch_dev *ptdev, uint16_t pid, const char *replies, const char *file);
+
+/* barcode.c */
+enum { PT_BARCODE_CODE128, PT_BARCODE_EAN13, PT_BARCODE_QR };
+enum { PT_QR_L, PT_QR_M, PT_QR_Q, PT_QR_H };	/* error correction levels */
+
+pt_bitmap ptouch_barcode(int type, const char *data, int ecc, int dpi, int height);
+
+/* session.c */
+enum { PT_JOB_CUT, PT_JOB_CHAIN };
+typedef struct _pt_session *pt_session;
+typedef struct _pt_job *pt_job;
+
+pt_session ptouch_session_open(pt_selector sel);
+pt_session ptouch_session_new(ptouch_dev ptdev);
+int ptouch_session_refresh(pt_session s);
+ptouch_dev ptouch_session_dev(pt_session s);
+int ptouch_session_tape_width(pt_session s);
+void ptouch_session_close(pt_session s);
+pt_job ptouch_job_begin(pt_session s, uint8_t page_flags);
+int ptouch_job_add_columns(pt_job j, const uint8_t *lines, int n);
+int ptouch_job_add_bitmap(pt_job j, pt_bitmap bm);
+int ptouch_job_lines(pt_job j);
+int ptouch_job_end(pt_job j, int how);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+	ptouch-print - Print labels with images or text on a Brother P-Touch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#define MAX_LINES 4	/* maybe this should depend on tape size */
+
+/* set by the program using render.c */
+extern bool debug;
+
+/* render.c */
+pt_bitmap bitmap_from_gd(gdImage *im);
+gdImage *bitmap_to_gd(pt_bitmap bm);
+pt_bitmap image_load(const char *file);
+int image_height(const char *file);
+int write_png(pt_bitmap im, const char *file);
+void report_abort(ptouch_dev ptdev, int lines);
+int print_img(ptouch_dev ptdev, pt_label im);
+int print_stream(ptouch_dev ptdev, const uint8_t *data, size_t len);
+int get_baselineoffset(char *text, char *font, int fsz);
+pt_bitmap render_text(char *font, int size, char *line[], int lines, int tape_width);
+pt_bitmap img_cutmark(int tape_width);
+pt_bitmap img_padding(int tape_width, int length);
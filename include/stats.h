@@ -0,0 +1,36 @@
+/*
+	ptouch-print - Print labels with images or text on a Brother P-Touch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* phases of a run timed by --stats */
+enum stats_phase {
+	STATS_OPEN,	/* finding and opening the printers */
+	STATS_INIT,
+	STATS_STATUS,
+	STATS_FONT,	/* resolving and sizing fonts */
+	STATS_RENDER,	/* all segments, see stats_segment() */
+	STATS_RASTER,	/* converting the label to raster lines */
+	STATS_SEND,	/* encoding and transmission */
+	STATS_PHASES
+};
+
+/* stats.c */
+void stats_enable(void);
+double stats_now(void);
+void stats_add(enum stats_phase ph, double since);
+void stats_segment(const char *kind, int width, double since);
+void stats_lines(int lines, size_t payload);
+void stats_report(FILE *f, const struct _pt_xfer_stats *xs, bool json);
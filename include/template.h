@@ -0,0 +1,21 @@
+/*
+	ptouch-print - Print labels with images or text on a Brother P-Touch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* template.c */
+int csv_split(char *line, char ***fields);
+int template_fields(const char *s, char **names, int n);
+char *template_expand(const char *s, char **names, char **values, int n);
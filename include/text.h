@@ -0,0 +1,35 @@
+/*
+	ptouch-print - Print labels with images or text on a Brother P-Touch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+struct _pt_bitmap;
+
+/* bounding box of a string drawn with its baseline at y=0 */
+struct text_metrics {
+	int width;
+	int height;
+	int ascent;	/* pixels above the baseline */
+	int descent;	/* pixels below the baseline */
+};
+
+/* text.c */
+int text_measure(char *font, int size, char *text, struct text_metrics *m);
+int text_font_file(char *font, const char **path, int64_t *mtime);
+int text_fit_size(char *font, char *line[], int lines, int want_px);
+char *text_render(struct _pt_bitmap *bm, char *font, int size, int x, int y, char *text);
+int text_cache_open(const char *file);
+int text_cache_save(void);
+void text_cache_clear(void);
@@ -0,0 +1,764 @@
+/*
+	libptouch - functions to help accessing a brother ptouch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#define _POSIX_C_SOURCE	200809L	/* needed for stpcpy() when using -std=c11 */
+
+#ifndef USING_CMAKE
+#include "config.h"
+#endif
+
+#include <stdio.h>	/* fprintf() */
+#include <stdlib.h>	/* malloc(), calloc(), free() */
+#include <string.h>	/* strlen(), strchr(), memset() */
+#include "gettext.h"	/* dgettext() */
+#include "ptouch.h"
+
+#define _(s) dgettext(PACKAGE, s)
+
+/* --------------------------------------------------------------------
+	Barcodes drawn straight into a bitmap of the label, every module a
+	whole number of pixels wide so that no bar is blurred or rounded
+	differently from the next. Linear codes take the full height,
+	QR codes the largest module size that fits with the quiet zone.
+   -------------------------------------------------------------------- */
+
+#define BARCODE_MODULE_MM	0.3	/* narrowest bar of linear codes */
+
+static int module_px(int dpi)
+{
+	int m=(int)(dpi * BARCODE_MODULE_MM / 25.4 + 0.5);
+
+	return (m > 0) ? m : 1;
+}
+
+/* a bitmap of the given modules, '1' for a bar */
+static pt_bitmap draw_modules(const char *modules, int dpi, int height)
+{
+	int m=module_px(dpi), n=(int)strlen(modules);
+	pt_bitmap bm;
+
+	if ((bm=ptouch_bitmap_new(n * m, height)) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		return NULL;
+	}
+	for (int i=0; i<n; i++) {
+		if (modules[i] == '1') {
+			ptouch_bitmap_fill(bm, i * m, 0, m, height, 1);
+		}
+	}
+	return bm;
+}
+
+/* append bars and spaces of the given widths, starting with a bar */
+static char *append_widths(char *out, const char *widths)
+{
+	for (int i=0; widths[i] != '\0'; i++) {
+		for (int k=0; k<widths[i] - '0'; k++) {
+			*out++=(i % 2 == 0) ? '1' : '0';
+		}
+	}
+	return out;
+}
+
+static char *append_quiet(char *out, int n)
+{
+	memset(out, '0', (size_t)n);
+	return out + n;
+}
+
+/* --------------------------------------------------------------------
+	Code 128: code set C packs pairs of digits, runs of digits switch
+	to it. Everything else is set B, or A for control characters.
+   -------------------------------------------------------------------- */
+static const char *code128_widths[107]={
+	"212222", "222122", "222221", "121223", "121322", "131222", "122213", "122312", "132212", "221213",
+	"221312", "231212", "112232", "122132", "122231", "113222", "123122", "123221", "223211", "221132",
+	"221231", "213212", "223112", "312131", "311222", "321122", "321221", "312212", "322112", "322211",
+	"212123", "212321", "232121", "111323", "131123", "131321", "112313", "132113", "132311", "211313",
+	"231113", "231311", "112133", "112331", "132131", "113123", "113321", "133121", "313121", "211331",
+	"231131", "213113", "213311", "213131", "311123", "311321", "331121", "312113", "312311", "332111",
+	"314111", "221411", "431111", "111224", "111422", "121124", "121421", "141122", "141221", "112214",
+	"112412", "122114", "122411", "142112", "142211", "241211", "221114", "413111", "241112", "134111",
+	"111242", "121142", "121241", "114212", "124112", "124211", "411212", "421112", "421211", "212141",
+	"214121", "412121", "111143", "111341", "131141", "114113", "114311", "411113", "411311", "113141",
+	"114131", "311141", "411131", "211412", "211214", "211232", "2331112"
+};
+
+enum { CODE128_A=101, CODE128_B=100, CODE128_C=99, CODE128_START_A=103, CODE128_START_B=104, CODE128_START_C=105, CODE128_STOP=106 };
+
+static int digits_at(const char *s)
+{
+	int n=0;
+
+	while ((s[n] >= '0') && (s[n] <= '9')) {
+		n++;
+	}
+	return n;
+}
+
+/* set A for control characters, set B for lower case letters */
+static int code128_set_for(const char *s)
+{
+	for (; *s != '\0'; s++) {
+		if ((unsigned char)*s < 32) {
+			return CODE128_A;
+		}
+		if ((unsigned char)*s >= 96) {
+			return CODE128_B;
+		}
+	}
+	return CODE128_B;
+}
+
+static pt_bitmap code128(const char *data, int dpi, int height)
+{
+	size_t len=strlen(data);
+	int *sym, n=0, set, d, sum;
+	char *modules, *o;
+	pt_bitmap bm;
+
+	if (len == 0) {
+		fprintf(stderr, _("Code 128 needs at least one character\n"));
+		return NULL;
+	}
+	for (size_t i=0; i<len; i++) {
+		if ((unsigned char)data[i] > 127) {
+			fprintf(stderr, _("Code 128 can only encode ASCII\n"));
+			return NULL;
+		}
+	}
+	/* start, at worst a switch and a symbol per character, check, stop */
+	if ((sym=malloc((2 * len + 3) * sizeof(*sym))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		return NULL;
+	}
+	d=digits_at(data);
+	if ((d >= 4) || ((d >= 2) && ((size_t)d == len))) {
+		set=CODE128_C;
+		sym[n++]=CODE128_START_C;
+	} else {
+		set=code128_set_for(data);
+		sym[n++]=(set == CODE128_A) ? CODE128_START_A : CODE128_START_B;
+	}
+	while (*data != '\0') {
+		d=digits_at(data);
+		if (set == CODE128_C) {
+			if (d >= 2) {
+				sym[n++]=(data[0] - '0') * 10 + (data[1] - '0');
+				data+=2;
+				continue;
+			}
+			set=code128_set_for(data);
+			sym[n++]=set;
+		} else if ((d >= 6) || ((d >= 4) && (data[d] == '\0'))) {
+			/* an odd digit goes first, the rest in pairs */
+			if (d % 2 == 1) {
+				sym[n++]=*data++ - 32;
+			}
+			set=CODE128_C;
+			sym[n++]=set;
+			continue;
+		}
+		if ((set == CODE128_B) && ((unsigned char)*data < 32)) {
+			set=CODE128_A;
+			sym[n++]=set;
+		} else if ((set == CODE128_A) && ((unsigned char)*data >= 96)) {
+			set=CODE128_B;
+			sym[n++]=set;
+		}
+		sym[n++]=((unsigned char)*data < 32) ? *data + 64 : *data - 32;
+		data++;
+	}
+	sum=sym[0];
+	for (int i=1; i<n; i++) {
+		sum+=sym[i] * i;
+	}
+	sym[n++]=sum % 103;
+	sym[n++]=CODE128_STOP;
+	if ((modules=malloc((size_t)n * 11 + 2 + 20 + 1)) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		free(sym);
+		return NULL;
+	}
+	o=append_quiet(modules, 10);
+	for (int i=0; i<n; i++) {
+		o=append_widths(o, code128_widths[sym[i]]);
+	}
+	o=append_quiet(o, 10);
+	*o='\0';
+	bm=draw_modules(modules, dpi, height);
+	free(modules);
+	free(sym);
+	return bm;
+}
+
+/* --------------------------------------------------------------------
+	EAN-13: 12 digits and a check digit, which is added if it is left
+	out and checked if it is not. The first digit is encoded in the
+	parity of the left half.
+   -------------------------------------------------------------------- */
+static const char *ean_l[10]={
+	"0001101", "0011001", "0010011", "0111101", "0100011", "0110001", "0101111", "0111011", "0110111", "0001011"
+};
+static const char *ean_g[10]={
+	"0100111", "0110011", "0011011", "0100001", "0011101", "0111001", "0000101", "0010001", "0001001", "0010111"
+};
+static const char *ean_r[10]={
+	"1110010", "1100110", "1101100", "1000010", "1011100", "1001110", "1010000", "1000100", "1001000", "1110100"
+};
+static const char *ean_parity[10]={
+	"LLLLLL", "LLGLGG", "LLGGLG", "LLGGGL", "LGLLGG", "LGGLLG", "LGGGLL", "LGLGLG", "LGLGGL", "LGGLGL"
+};
+
+static pt_bitmap ean13(const char *data, int dpi, int height)
+{
+	char modules[11 + 95 + 7 + 1], *o;
+	int digit[13], sum=0, len=(int)strlen(data);
+
+	if ((digits_at(data) != len) || ((len != 12) && (len != 13))) {
+		fprintf(stderr, _("EAN-13 needs 12 or 13 digits\n"));
+		return NULL;
+	}
+	for (int i=0; i<12; i++) {
+		digit[i]=data[i] - '0';
+		sum+=(i % 2 == 0) ? digit[i] : digit[i] * 3;
+	}
+	digit[12]=(10 - sum % 10) % 10;
+	if ((len == 13) && (data[12] - '0' != digit[12])) {
+		fprintf(stderr, _("wrong EAN-13 check digit, it should be %i\n"), digit[12]);
+		return NULL;
+	}
+	o=append_quiet(modules, 11);
+	o=stpcpy(o, "101");
+	for (int i=1; i<7; i++) {
+		o=stpcpy(o, (ean_parity[digit[0]][i-1] == 'L') ? ean_l[digit[i]] : ean_g[digit[i]]);
+	}
+	o=stpcpy(o, "01010");
+	for (int i=7; i<13; i++) {
+		o=stpcpy(o, ean_r[digit[i]]);
+	}
+	o=stpcpy(o, "101");
+	o=append_quiet(o, 7);
+	*o='\0';
+	return draw_modules(modules, dpi, height);
+}
+
+/* --------------------------------------------------------------------
+	QR codes, model 2, versions 1 to 40. The data is encoded in one
+	segment in numeric, alphanumeric or byte mode, whichever is the
+	shortest, in the smallest version it fits. Of the eight masks the
+	one with the lowest penalty is used.
+   -------------------------------------------------------------------- */
+static const int8_t qr_ecc_per_block[4][41]={
+	{ -1, 7, 10, 15, 20, 26, 18, 20, 24, 30, 18, 20, 24, 26, 30, 22, 24, 28, 30, 28, 28, 28, 28, 30, 30, 26, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30 },
+	{ -1, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26, 30, 22, 22, 24, 24, 28, 28, 26, 26, 26, 26, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28 },
+	{ -1, 13, 22, 18, 26, 18, 24, 18, 22, 20, 24, 28, 26, 24, 20, 30, 24, 28, 28, 26, 30, 28, 30, 30, 30, 30, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30 },
+	{ -1, 17, 28, 22, 16, 22, 28, 26, 26, 24, 28, 24, 28, 22, 24, 24, 30, 28, 28, 26, 28, 30, 24, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30 }
+};
+
+static const int8_t qr_blocks[4][41]={
+	{ -1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 4, 4, 4, 4, 4, 6, 6, 6, 6, 7, 8, 8, 9, 9, 10, 12, 12, 12, 13, 14, 15, 16, 17, 18, 19, 19, 20, 21, 22, 24, 25 },
+	{ -1, 1, 1, 1, 2, 2, 4, 4, 4, 5, 5, 5, 8, 9, 9, 10, 10, 11, 13, 14, 16, 17, 17, 18, 20, 21, 23, 25, 26, 28, 29, 31, 33, 35, 37, 38, 40, 43, 45, 47, 49 },
+	{ -1, 1, 1, 2, 2, 4, 4, 6, 6, 8, 8, 8, 10, 12, 16, 12, 17, 16, 18, 21, 20, 23, 23, 25, 27, 29, 34, 34, 35, 38, 40, 43, 45, 48, 51, 53, 56, 59, 62, 65, 68 },
+	{ -1, 1, 1, 2, 4, 4, 4, 5, 6, 8, 8, 11, 11, 16, 16, 18, 16, 19, 21, 25, 25, 25, 34, 30, 32, 35, 37, 40, 42, 45, 48, 51, 54, 57, 60, 63, 66, 70, 74, 77, 81 }
+};
+
+/* the two bits of the level in the format information */
+static const int qr_ecc_format[4]={ 1, 0, 3, 2 };
+
+static const char qr_alnum[]="0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+
+enum { QR_NUMERIC, QR_ALNUM, QR_BYTE };
+
+struct qr {
+	int version;
+	int size;
+	uint8_t *mod;		/* size * size, 1 for dark */
+	uint8_t *func;		/* 1 for modules of the function patterns */
+	uint8_t *bits;		/* data and ecc codewords */
+	size_t nbits;
+};
+
+/* bits of data that fit in a version, with ecc */
+static int qr_raw_modules(int ver)
+{
+	int n=(16 * ver + 128) * ver + 64;
+
+	if (ver >= 2) {
+		int align=ver / 7 + 2;
+		n-=(25 * align - 10) * align - 55;
+		if (ver >= 7) {
+			n-=36;
+		}
+	}
+	return n;
+}
+
+static int qr_data_codewords(int ver, int ecc)
+{
+	return qr_raw_modules(ver) / 8 - qr_ecc_per_block[ecc][ver] * qr_blocks[ecc][ver];
+}
+
+static int qr_count_bits(int mode, int ver)
+{
+	static const int bits[3][3]={ { 10, 12, 14 }, { 9, 11, 13 }, { 8, 16, 16 } };
+
+	return bits[mode][(ver <= 9) ? 0 : ((ver <= 26) ? 1 : 2)];
+}
+
+static int qr_mode(const char *data)
+{
+	if ((size_t)digits_at(data) == strlen(data)) {
+		return QR_NUMERIC;
+	}
+	for (const char *p=data; *p != '\0'; p++) {
+		if (strchr(qr_alnum, *p) == NULL) {
+			return QR_BYTE;
+		}
+	}
+	return QR_ALNUM;
+}
+
+static int qr_data_bits(int mode, size_t len)
+{
+	switch (mode) {
+	case QR_NUMERIC:
+		return (int)(len / 3 * 10 + ((len % 3 == 2) ? 7 : ((len % 3 == 1) ? 4 : 0)));
+	case QR_ALNUM:
+		return (int)(len / 2 * 11 + (len % 2) * 6);
+	default:
+		return (int)(len * 8);
+	}
+}
+
+static void put_bits(uint8_t *buf, size_t *pos, unsigned int val, int n)
+{
+	for (int i=n-1; i>=0; i--, (*pos)++) {
+		if ((val >> i) & 1) {
+			buf[*pos / 8]|=(uint8_t)(0x80 >> (*pos % 8));
+		}
+	}
+}
+
+/* the data codewords of data, with mode, count and padding */
+static void qr_encode_data(uint8_t *buf, int ncw, int mode, const char *data, int ver)
+{
+	size_t len=strlen(data), pos=0, cap=(size_t)ncw * 8;
+
+	memset(buf, 0, (size_t)ncw);
+	put_bits(buf, &pos, 1u << mode, 4);
+	put_bits(buf, &pos, (unsigned int)len, qr_count_bits(mode, ver));
+	for (size_t i=0; i<len; ) {
+		if (mode == QR_NUMERIC) {
+			unsigned int v=0;
+			int k;
+			for (k=0; (k < 3) && (i < len); k++, i++) {
+				v=v * 10 + (unsigned int)(data[i] - '0');
+			}
+			put_bits(buf, &pos, v, k * 3 + 1);
+		} else if (mode == QR_ALNUM) {
+			unsigned int v=(unsigned int)(strchr(qr_alnum, data[i++]) - qr_alnum);
+			if (i < len) {
+				v=v * 45 + (unsigned int)(strchr(qr_alnum, data[i++]) - qr_alnum);
+				put_bits(buf, &pos, v, 11);
+			} else {
+				put_bits(buf, &pos, v, 6);
+			}
+		} else {
+			put_bits(buf, &pos, (unsigned char)data[i++], 8);
+		}
+	}
+	/* terminator, up to the next byte, then alternating pad bytes */
+	pos+=(cap - pos < 4) ? cap - pos : 4;
+	pos=(pos + 7) / 8 * 8;
+	for (int pad=0xec; pos < cap; pad^=0xec ^ 0x11) {
+		put_bits(buf, &pos, (unsigned int)pad, 8);
+	}
+}
+
+static uint8_t gf_mul(uint8_t x, uint8_t y)
+{
+	unsigned int z=0;
+
+	for (int i=7; i>=0; i--) {
+		z=(z << 1) ^ ((z >> 7) * 0x11d);
+		z^=((y >> i) & 1) * x;
+	}
+	return (uint8_t)z;
+}
+
+/* the ecc codewords of n data codewords */
+static void qr_ecc(const uint8_t *data, int n, uint8_t *ecc, int necc)
+{
+	uint8_t div[30], root=1, factor;
+
+	memset(div, 0, sizeof(div));
+	div[necc - 1]=1;
+	for (int i=0; i<necc; i++) {
+		for (int j=0; j<necc; j++) {
+			div[j]=gf_mul(div[j], root);
+			if (j + 1 < necc) {
+				div[j]^=div[j + 1];
+			}
+		}
+		root=gf_mul(root, 0x02);
+	}
+	memset(ecc, 0, (size_t)necc);
+	for (int i=0; i<n; i++) {
+		factor=data[i] ^ ecc[0];
+		memmove(ecc, ecc + 1, (size_t)necc - 1);
+		ecc[necc - 1]=0;
+		for (int j=0; j<necc; j++) {
+			ecc[j]^=gf_mul(div[j], factor);
+		}
+	}
+}
+
+/* data and ecc of all blocks, interleaved */
+static uint8_t *qr_codewords(const uint8_t *data, int ver, int ecc)
+{
+	int nblocks=qr_blocks[ecc][ver], necc=qr_ecc_per_block[ecc][ver];
+	int raw=qr_raw_modules(ver) / 8;
+	int nshort=nblocks - raw % nblocks, short_len=raw / nblocks - necc;
+	uint8_t *out, *blk_ecc, *o;
+	int start;
+
+	if ((out=malloc((size_t)raw)) == NULL) {
+		return NULL;
+	}
+	if ((blk_ecc=malloc((size_t)nblocks * (size_t)necc)) == NULL) {
+		free(out);
+		return NULL;
+	}
+	start=0;
+	for (int b=0; b<nblocks; b++) {
+		int len=short_len + (b >= nshort);
+		qr_ecc(data + start, len, blk_ecc + b * necc, necc);
+		start+=len;
+	}
+	o=out;
+	for (int i=0; i<=short_len; i++) {
+		start=0;
+		for (int b=0; b<nblocks; b++) {
+			int len=short_len + (b >= nshort);
+			if (i < len) {
+				*o++=data[start + i];
+			}
+			start+=len;
+		}
+	}
+	for (int i=0; i<necc; i++) {
+		for (int b=0; b<nblocks; b++) {
+			*o++=blk_ecc[b * necc + i];
+		}
+	}
+	free(blk_ecc);
+	return out;
+}
+
+static void qr_set(struct qr *q, int x, int y, int dark)
+{
+	q->mod[y * q->size + x]=(uint8_t)dark;
+	q->func[y * q->size + x]=1;
+}
+
+static void qr_finder(struct qr *q, int cx, int cy)
+{
+	for (int dy=-4; dy<=4; dy++) {
+		for (int dx=-4; dx<=4; dx++) {
+			int d=abs(dx) > abs(dy) ? abs(dx) : abs(dy);
+			int x=cx + dx, y=cy + dy;
+			if ((x >= 0) && (x < q->size) && (y >= 0) && (y < q->size)) {
+				qr_set(q, x, y, (d != 2) && (d != 4));
+			}
+		}
+	}
+}
+
+static void qr_alignment(struct qr *q, int cx, int cy)
+{
+	for (int dy=-2; dy<=2; dy++) {
+		for (int dx=-2; dx<=2; dx++) {
+			int d=abs(dx) > abs(dy) ? abs(dx) : abs(dy);
+			qr_set(q, cx + dx, cy + dy, d != 1);
+		}
+	}
+}
+
+static void qr_format(struct qr *q, int ecc, int mask)
+{
+	int data=(qr_ecc_format[ecc] << 3) | mask, rem=data, bits;
+
+	for (int i=0; i<10; i++) {
+		rem=(rem << 1) ^ ((rem >> 9) * 0x537);
+	}
+	bits=((data << 10) | rem) ^ 0x5412;
+	for (int i=0; i<=5; i++) {
+		qr_set(q, 8, i, (bits >> i) & 1);
+	}
+	qr_set(q, 8, 7, (bits >> 6) & 1);
+	qr_set(q, 8, 8, (bits >> 7) & 1);
+	qr_set(q, 7, 8, (bits >> 8) & 1);
+	for (int i=9; i<15; i++) {
+		qr_set(q, 14 - i, 8, (bits >> i) & 1);
+	}
+	for (int i=0; i<8; i++) {
+		qr_set(q, q->size - 1 - i, 8, (bits >> i) & 1);
+	}
+	for (int i=8; i<15; i++) {
+		qr_set(q, 8, q->size - 15 + i, (bits >> i) & 1);
+	}
+	qr_set(q, 8, q->size - 8, 1);	/* always dark */
+}
+
+static void qr_function_patterns(struct qr *q, int ecc)
+{
+	int n=q->size, ver=q->version;
+
+	for (int i=0; i<n; i++) {
+		qr_set(q, 6, i, i % 2 == 0);
+		qr_set(q, i, 6, i % 2 == 0);
+	}
+	qr_finder(q, 3, 3);
+	qr_finder(q, n - 4, 3);
+	qr_finder(q, 3, n - 4);
+	if (ver >= 2) {
+		int align=ver / 7 + 2, pos[7];
+		int step=(ver * 8 + align * 3 + 5) / (align * 4 - 4) * 2;
+		pos[0]=6;
+		for (int i=align - 1, p=n - 7; i>=1; i--, p-=step) {
+			pos[i]=p;
+		}
+		for (int i=0; i<align; i++) {
+			for (int j=0; j<align; j++) {
+				/* not on the finder patterns */
+				if (((i == 0) && (j == 0)) || ((i == 0) && (j == align - 1)) || ((i == align - 1) && (j == 0))) {
+					continue;
+				}
+				qr_alignment(q, pos[i], pos[j]);
+			}
+		}
+	}
+	qr_format(q, ecc, 0);	/* reserves the area, redrawn with the mask */
+	if (ver >= 7) {
+		int rem=ver;
+		long bits;
+		for (int i=0; i<12; i++) {
+			rem=(rem << 1) ^ ((rem >> 11) * 0x1f25);
+		}
+		bits=((long)ver << 12) | rem;
+		for (int i=0; i<18; i++) {
+			int a=n - 11 + i % 3, b=i / 3, dark=(int)((bits >> i) & 1);
+			qr_set(q, a, b, dark);
+			qr_set(q, b, a, dark);
+		}
+	}
+}
+
+/* the codewords in the zig zag of column pairs, right to left */
+static void qr_place(struct qr *q, const uint8_t *cw, size_t nbits)
+{
+	int n=q->size;
+	size_t i=0;
+
+	for (int right=n - 1; right>=1; right-=2) {
+		if (right == 6) {
+			right=5;	/* skip the vertical timing pattern */
+		}
+		for (int vert=0; vert<n; vert++) {
+			for (int j=0; j<2; j++) {
+				int x=right - j;
+				int y=(((right + 1) & 2) == 0) ? n - 1 - vert : vert;
+				if (!q->func[y * n + x] && (i < nbits)) {
+					q->mod[y * n + x]=(cw[i / 8] >> (7 - i % 8)) & 1;
+					i++;
+				}
+			}
+		}
+	}
+}
+
+static void qr_mask(struct qr *q, int mask)
+{
+	int n=q->size;
+
+	for (int y=0; y<n; y++) {
+		for (int x=0; x<n; x++) {
+			int inv;
+			switch (mask) {
+			case 0: inv=(x + y) % 2 == 0; break;
+			case 1: inv=y % 2 == 0; break;
+			case 2: inv=x % 3 == 0; break;
+			case 3: inv=(x + y) % 3 == 0; break;
+			case 4: inv=(x / 3 + y / 2) % 2 == 0; break;
+			case 5: inv=x * y % 2 + x * y % 3 == 0; break;
+			case 6: inv=(x * y % 2 + x * y % 3) % 2 == 0; break;
+			default: inv=((x + y) % 2 + x * y % 3) % 2 == 0; break;
+			}
+			if (!q->func[y * n + x] && inv) {
+				q->mod[y * n + x]^=1;
+			}
+		}
+	}
+}
+
+/* the module at step i of row or column k */
+static int qr_line(struct qr *q, int k, int i, int col)
+{
+	return col ? q->mod[i * q->size + k] : q->mod[k * q->size + i];
+}
+
+static long qr_penalty(struct qr *q)
+{
+	static const uint8_t finder[11]={ 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 0 };
+	int n=q->size;
+	long p=0, dark=0;
+
+	for (int col=0; col<2; col++) {
+		for (int k=0; k<n; k++) {
+			int run=1;
+			for (int i=1; i<=n; i++) {
+				if ((i < n) && (qr_line(q, k, i, col) == qr_line(q, k, i - 1, col))) {
+					run++;
+					continue;
+				}
+				if (run >= 5) {
+					p+=3 + run - 5;
+				}
+				run=1;
+			}
+			/* 1:1:3:1:1 like a finder, light on one side */
+			for (int i=0; i + 11 <= n; i++) {
+				int fwd=1, back=1;
+				for (int j=0; j<11; j++) {
+					fwd&=qr_line(q, k, i + j, col) == finder[j];
+					back&=qr_line(q, k, i + j, col) == finder[10 - j];
+				}
+				p+=40 * (fwd + back);
+			}
+		}
+	}
+	for (int y=0; y<n; y++) {
+		for (int x=0; x<n; x++) {
+			int c=q->mod[y * n + x];
+			dark+=c;
+			if ((x + 1 < n) && (y + 1 < n) && (c == q->mod[y * n + x + 1])
+				&& (c == q->mod[(y + 1) * n + x]) && (c == q->mod[(y + 1) * n + x + 1])) {
+				p+=3;
+			}
+		}
+	}
+	p+=10 * ((labs(dark * 20 - (long)n * n * 10) + (long)n * n - 1) / ((long)n * n) - 1);
+	return p;
+}
+
+static int qr_build(struct qr *q, const char *data, int ecc)
+{
+	int mode=qr_mode(data), ncw=0, best=0;
+	size_t len=strlen(data);
+	uint8_t *dcw, *cw;
+	long pen, min=-1;
+
+	for (q->version=1; q->version<=40; q->version++) {
+		ncw=qr_data_codewords(q->version, ecc);
+		if (4 + qr_count_bits(mode, q->version) + qr_data_bits(mode, len) <= ncw * 8) {
+			break;
+		}
+	}
+	if (q->version > 40) {
+		fprintf(stderr, _("too much data for a QR code\n"));
+		return -1;
+	}
+	q->size=q->version * 4 + 17;
+	q->mod=calloc((size_t)q->size, (size_t)q->size);
+	q->func=calloc((size_t)q->size, (size_t)q->size);
+	if ((dcw=malloc((size_t)ncw)) == NULL) {
+		return -1;
+	}
+	qr_encode_data(dcw, ncw, mode, data, q->version);
+	cw=qr_codewords(dcw, q->version, ecc);
+	free(dcw);
+	if ((cw == NULL) || (q->mod == NULL) || (q->func == NULL)) {
+		free(cw);
+		return -1;
+	}
+	qr_function_patterns(q, ecc);
+	qr_place(q, cw, (size_t)(qr_raw_modules(q->version) / 8) * 8);
+	free(cw);
+	for (int mask=0; mask<8; mask++) {
+		qr_mask(q, mask);
+		qr_format(q, ecc, mask);
+		if (((pen=qr_penalty(q)) < min) || (min < 0)) {
+			min=pen;
+			best=mask;
+		}
+		qr_mask(q, mask);	/* undo */
+	}
+	qr_mask(q, best);
+	qr_format(q, ecc, best);
+	return 0;
+}
+
+static pt_bitmap qr(const char *data, int ecc, int height)
+{
+	struct qr q={ 0 };
+	pt_bitmap bm=NULL;
+	int m, y0;
+
+	if ((ecc < PT_QR_L) || (ecc > PT_QR_H)) {
+		return NULL;
+	}
+	if (qr_build(&q, data, ecc) != 0) {
+		goto out;
+	}
+	/* a quiet zone of 4 modules on every side */
+	if ((m=height / (q.size + 8)) < 1) {
+		fprintf(stderr, _("a QR code of version %i does not fit on this tape\n"), q.version);
+		goto out;
+	}
+	if ((bm=ptouch_bitmap_new((q.size + 8) * m, height)) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		goto out;
+	}
+	y0=(height - q.size * m) / 2;
+	for (int y=0; y<q.size; y++) {
+		for (int x=0; x<q.size; x++) {
+			if (q.mod[y * q.size + x]) {
+				ptouch_bitmap_fill(bm, (x + 4) * m, y0 + y * m, m, m, 1);
+			}
+		}
+	}
+out:
+	free(q.mod);
+	free(q.func);
+	return bm;
+}
+
+/* a barcode of the given type for a printer of dpi, height pixels high.
+   ecc is the error correction level of QR codes. */
+pt_bitmap ptouch_barcode(int type, const char *data, int ecc, int dpi, int height)
+{
+	switch (type) {
+	case PT_BARCODE_CODE128:
+		return code128(data, dpi, height);
+	case PT_BARCODE_EAN13:
+		return ean13(data, dpi, height);
+	case PT_BARCODE_QR:
+		return qr(data, ecc, height);
+	}
+	return NULL;
+}
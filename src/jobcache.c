@@ -0,0 +1,237 @@
+/*
+	ptouch-print - Print labels with images or text on a Brother P-Touch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#define _POSIX_C_SOURCE	200809L	/* needed for mkstemp(), futimens() when using -std=c11 */
+
+#ifndef USING_CMAKE
+#include "config.h"
+#endif
+
+#include <stdio.h>	/* printf(), snprintf(), rename() */
+#include <stdlib.h>	/* malloc(), qsort() */
+#include <stdint.h>
+#include <string.h>	/* strlen(), strspn() */
+#include <errno.h>
+#include <unistd.h>	/* write(), close(), unlink() */
+#include <fcntl.h>	/* open() */
+#include <dirent.h>	/* opendir() */
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>	/* fstat(), mkdir(), futimens() */
+#include <sys/mman.h>	/* mmap() */
+#include "gettext.h"	/* gettext(), ngettext() */
+#include "jobcache.h"
+
+#define _(s) gettext(s)
+
+/* --------------------------------------------------------------------
+	Cache of the command streams of printed labels, one file per label
+	named after the hash of everything that went into it. A hit is
+	mapped and sent as it is. Files are touched when used, and once the
+	directory grows beyond the limit the least recently used go first.
+   -------------------------------------------------------------------- */
+
+#define JOBCACHE_NAME	16	/* hex digits of a key */
+
+struct jobcache_entry {
+	char name[JOBCACHE_NAME + 1];
+	off_t size;
+	struct timespec used;
+};
+
+static pthread_mutex_t jobcache_lock=PTHREAD_MUTEX_INITIALIZER;
+static char *jobcache_dir;
+static size_t jobcache_limit;
+
+int jobcache_open(const char *dir, size_t limit)
+{
+	if ((mkdir(dir, 0777) != 0) && (errno != EEXIST)) {
+		printf(_("can not create cache directory '%s': %s\n"), dir, strerror(errno));
+		return -1;
+	}
+	if ((jobcache_dir=strdup(dir)) == NULL) {
+		return -1;
+	}
+	jobcache_limit=limit;
+	return 0;
+}
+
+/* 64 bit FNV-1a */
+uint64_t jobcache_hash(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p=data;
+
+	for (size_t i=0; i<len; i++) {
+		h=(h ^ p[i]) * UINT64_C(1099511628211);
+	}
+	return h;
+}
+
+/* hash the contents of file, 0 if it can not be read */
+uint64_t jobcache_hash_file(uint64_t h, const char *file)
+{
+	uint8_t buf[16384];
+	size_t n;
+	FILE *f;
+
+	if ((f=fopen(file, "rb")) == NULL) {
+		return 0;
+	}
+	while ((n=fread(buf, 1, sizeof(buf), f)) > 0) {
+		h=jobcache_hash(h, buf, n);
+	}
+	if (ferror(f)) {
+		h=0;
+	}
+	fclose(f);
+	return h;
+}
+
+static void jobcache_path(char *path, size_t size, uint64_t key)
+{
+	snprintf(path, size, "%s/%016llx", jobcache_dir, (unsigned long long)key);
+}
+
+/* map the stream cached under key, 0 on a hit */
+int jobcache_get(uint64_t key, const uint8_t **data, size_t *len)
+{
+	char path[strlen(jobcache_dir) + JOBCACHE_NAME + 2];
+	struct stat st;
+	void *map;
+	int fd;
+
+	jobcache_path(path, sizeof(path), key);
+	if ((fd=open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+		close(fd);
+		return -1;
+	}
+	if ((map=mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	futimens(fd, NULL);	/* most recently used */
+	close(fd);
+	*data=map;
+	*len=(size_t)st.st_size;
+	return 0;
+}
+
+void jobcache_release(const uint8_t *data, size_t len)
+{
+	munmap((void *)data, len);
+}
+
+static int cmp_used(const void *a, const void *b)
+{
+	const struct jobcache_entry *x=a, *y=b;
+
+	if (x->used.tv_sec != y->used.tv_sec) {
+		return (x->used.tv_sec < y->used.tv_sec) ? -1 : 1;
+	}
+	return (x->used.tv_nsec < y->used.tv_nsec) ? -1 : (x->used.tv_nsec > y->used.tv_nsec);
+}
+
+/* remove the least recently used entries until the cache fits its limit */
+static void jobcache_trim(void)
+{
+	char path[strlen(jobcache_dir) + JOBCACHE_NAME + 2];
+	struct jobcache_entry *e=NULL, *tmp;
+	size_t n=0, alloc=0, total=0;
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+
+	if ((dir=opendir(jobcache_dir)) == NULL) {
+		return;
+	}
+	while ((d=readdir(dir)) != NULL) {
+		if ((strlen(d->d_name) != JOBCACHE_NAME) || (strspn(d->d_name, "0123456789abcdef") != JOBCACHE_NAME)) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", jobcache_dir, d->d_name);
+		if (stat(path, &st) != 0) {
+			continue;
+		}
+		if (n == alloc) {
+			alloc=alloc ? alloc * 2 : 64;
+			if ((tmp=realloc(e, alloc * sizeof(*e))) == NULL) {
+				break;
+			}
+			e=tmp;
+		}
+		memcpy(e[n].name, d->d_name, sizeof(e[n].name));
+		e[n].size=st.st_size;
+		e[n].used=st.st_mtim;
+		total+=(size_t)st.st_size;
+		n++;
+	}
+	closedir(dir);
+	if (total > jobcache_limit) {
+		qsort(e, n, sizeof(*e), cmp_used);
+		for (size_t i=0; (i < n) && (total > jobcache_limit); i++) {
+			snprintf(path, sizeof(path), "%s/%s", jobcache_dir, e[i].name);
+			if (unlink(path) == 0) {
+				total-=(size_t)e[i].size;
+			}
+		}
+	}
+	free(e);
+}
+
+/* store a stream under key, written to a temporary file first so
+   nobody ever maps half an entry */
+int jobcache_put(uint64_t key, const uint8_t *data, size_t len)
+{
+	char path[strlen(jobcache_dir) + JOBCACHE_NAME + 2];
+	char tmp[strlen(jobcache_dir) + 16];
+	size_t done=0;
+	ssize_t r;
+	int fd;
+
+	if ((len == 0) || (len > jobcache_limit)) {
+		return -1;
+	}
+	snprintf(tmp, sizeof(tmp), "%s/.new-XXXXXX", jobcache_dir);
+	if ((fd=mkstemp(tmp)) < 0) {
+		return -1;
+	}
+	while (done < len) {
+		if ((r=write(fd, data + done, len - done)) <= 0) {
+			close(fd);
+			unlink(tmp);
+			return -1;
+		}
+		done+=(size_t)r;
+	}
+	if (close(fd) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+	jobcache_path(path, sizeof(path), key);
+	pthread_mutex_lock(&jobcache_lock);
+	if (rename(tmp, path) != 0) {
+		pthread_mutex_unlock(&jobcache_lock);
+		unlink(tmp);
+		return -1;
+	}
+	jobcache_trim();
+	pthread_mutex_unlock(&jobcache_lock);
+	return 0;
+}
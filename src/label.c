@@ -0,0 +1,424 @@
+/*
+	libptouch - labels composed of a list of bitmap segments
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdlib.h>	/* malloc(), realloc(), free() */
+#include <pthread.h>
+#include "ptouch.h"
+
+/* lazy segments rendered ahead per thread while a label is streamed */
+#define LABEL_AHEAD	2
+
+pt_label ptouch_label_new(void)
+{
+	return calloc(1, sizeof(struct _pt_label));
+}
+
+void ptouch_label_free(pt_label l)
+{
+	if (l == NULL) {
+		return;
+	}
+	for (int i=0; i < l->nseg; i++) {
+		ptouch_bitmap_free(l->seg[i].bm);
+	}
+	free(l->seg);
+	free(l);
+}
+
+static struct _pt_label_seg *label_newseg(pt_label l)
+{
+	struct _pt_label_seg *seg;
+
+	if (l->nseg == l->allocated) {
+		int n=(l->allocated > 0) ? l->allocated * 2 : 16;
+		if ((seg=realloc(l->seg, (size_t)n * sizeof(*seg))) == NULL) {
+			return NULL;
+		}
+		l->seg=seg;
+		l->allocated=n;
+	}
+	seg=&l->seg[l->nseg++];
+	seg->bm=NULL;
+	seg->x=l->width;
+	seg->height=0;
+	seg->render=NULL;
+	seg->ctx=NULL;
+	seg->failed=0;
+	return seg;
+}
+
+/* add bm at the end of the label, the label takes ownership of it.
+   Nothing is copied, so appending is O(1) amortized. */
+int ptouch_label_append(pt_label l, pt_bitmap bm)
+{
+	struct _pt_label_seg *seg;
+
+	if ((l == NULL) || (bm == NULL)) {
+		return -1;
+	}
+	if ((seg=label_newseg(l)) == NULL) {
+		return -1;
+	}
+	seg->bm=bm;
+	seg->height=bm->height;
+	l->width+=bm->width;
+	if (bm->height > l->height) {
+		l->height=bm->height;
+	}
+	return 0;
+}
+
+/* Add a segment that is only rendered by render(ctx) when its columns are
+   needed. height must be known up front since the label is centered on
+   the tape before the first column is sent; the width is only known once
+   the segment has been rendered. ctx stays owned by the caller. */
+int ptouch_label_append_lazy(pt_label l, int height, pt_bitmap (*render)(void *ctx), void *ctx)
+{
+	struct _pt_label_seg *seg;
+
+	if ((l == NULL) || (render == NULL)) {
+		return -1;
+	}
+	if ((seg=label_newseg(l)) == NULL) {
+		return -1;
+	}
+	seg->height=height;
+	seg->render=render;
+	seg->ctx=ctx;
+	l->lazy++;
+	if (height > l->height) {
+		l->height=height;
+	}
+	return 0;
+}
+
+/* Lazy segments are rendered by a pool of threads that is started once
+   and shared by all labels, so printing on several printers at once does
+   not start a set of threads per label. Each label that needs segments
+   rendered queues a batch, the thread streaming the label works on its
+   own batch too and waits until the pool is done with the rest. */
+struct render_batch {
+	pt_label l;
+	int next;		/* next segment to hand out */
+	int end;
+	int busy;		/* segments handed out and not rendered yet */
+	struct render_batch *link;
+};
+
+struct _pt_render_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a batch was queued or the pool stops */
+	pthread_cond_t done;	/* a segment was rendered */
+	struct render_batch *queue;	/* batches with segments left */
+	int started;		/* workers, not counting the callers */
+	int stop;
+	pthread_t t[];
+};
+
+static int label_render_seg(pt_label l, struct _pt_label_seg *seg)
+{
+	if (seg->failed) {
+		return -1;
+	}
+	if ((seg->bm == NULL) && ((seg->bm=seg->render(seg->ctx)) == NULL)) {
+		seg->failed=1;
+		return -1;
+	}
+	if (seg->bm->height > l->height) {
+		ptouch_bitmap_free(seg->bm);
+		seg->bm=NULL;
+		seg->failed=1;
+		return -1;
+	}
+	return 0;
+}
+
+/* take the next segment of b, called with pool->lock held. Returns its
+   index or -1 if b has none left. */
+static int render_batch_take(pt_render_pool pool, struct render_batch *b)
+{
+	struct render_batch **p;
+	int i;
+
+	if (b->next >= b->end) {
+		return -1;
+	}
+	i=b->next++;
+	b->busy++;
+	if (b->next >= b->end) {
+		for (p=&pool->queue; *p != b; p=&(*p)->link);
+		*p=b->link;
+	}
+	return i;
+}
+
+/* render segment i of b, called with pool->lock held */
+static void render_batch_seg(pt_render_pool pool, struct render_batch *b, int i)
+{
+	/* every segment is only touched by the thread that took it */
+	struct _pt_label_seg *seg=&b->l->seg[i];
+
+	pthread_mutex_unlock(&pool->lock);
+	if ((seg->bm == NULL) && !seg->failed) {
+		label_render_seg(b->l, seg);
+	}
+	pthread_mutex_lock(&pool->lock);
+	if (--b->busy == 0) {
+		pthread_cond_broadcast(&pool->done);
+	}
+}
+
+static void *render_pool_worker(void *arg)
+{
+	pt_render_pool pool=arg;
+	struct render_batch *b;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		if ((b=pool->queue) == NULL) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+		i=render_batch_take(pool, b);
+		render_batch_seg(pool, b, i);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Start a pool that renders on n threads, the threads streaming labels
+   are counted as one of them, so n-1 threads are started. render() must
+   be safe to call from several threads at once, each segment's bitmap
+   does not depend on which thread rendered it, so labels come out the
+   same. Returns NULL if out of memory. */
+pt_render_pool ptouch_render_pool_new(int n)
+{
+	pt_render_pool pool;
+	int threads=(n > 1) ? n - 1 : 0;
+
+	if ((pool=calloc(1, sizeof(struct _pt_render_pool) + (size_t)threads * sizeof(pthread_t))) == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	while (pool->started < threads) {
+		if (pthread_create(&pool->t[pool->started], NULL, render_pool_worker, pool) != 0) {
+			break;
+		}
+		pool->started++;
+	}
+	return pool;
+}
+
+/* stop the pool, no label using it may be streamed any more */
+void ptouch_render_pool_free(pt_render_pool pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->stop=1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i=0; i<pool->started; i++) {
+		pthread_join(pool->t[i], NULL);
+	}
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/* render the lazy segments of l on pool, NULL renders them one by one
+   on the thread streaming the label */
+void ptouch_label_set_pool(pt_label l, pt_render_pool pool)
+{
+	l->pool=pool;
+}
+
+/* render segments first..end-1 that are not rendered yet in parallel,
+   errors are left for label_render_seg() to report */
+static void label_render_ahead(pt_label l, int first, int end)
+{
+	pt_render_pool pool=l->pool;
+	struct render_batch b={ .l=l, .next=first, .end=(end < l->nseg) ? end : l->nseg };
+	int todo=0, i;
+
+	for (i=first; i<b.end; i++) {
+		todo+=(l->seg[i].bm == NULL) && !l->seg[i].failed;
+	}
+	if ((pool == NULL) || (pool->started == 0) || (todo < 2)) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	b.link=pool->queue;
+	pool->queue=&b;
+	pthread_cond_broadcast(&pool->work);
+	/* the calling thread is one of the workers */
+	while ((i=render_batch_take(pool, &b)) >= 0) {
+		render_batch_seg(pool, &b, i);
+	}
+	while (b.busy > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* drop the bitmap of a lazy segment once it has been streamed */
+static void label_release_seg(struct _pt_label_seg *seg)
+{
+	if (seg->render != NULL) {
+		ptouch_bitmap_free(seg->bm);
+		seg->bm=NULL;
+	}
+}
+
+/* start streaming from the first column again */
+void ptouch_label_rewind(pt_label l)
+{
+	if ((l->stream_seg < l->nseg) && (l->stream_x > 0)) {
+		label_release_seg(&l->seg[l->stream_seg]);
+	}
+	l->stream_seg=0;
+	l->stream_x=0;
+}
+
+/* Get the segment the next raster line comes from ready. Lazy segments
+   are rendered when their first column is needed and freed after their
+   last one, so only one segment is held in memory at a time, however
+   long the label is. Returns 1 if there is a next line, 0 at the end of
+   the label and -1 on errors. */
+int ptouch_label_ready(pt_label l)
+{
+	struct _pt_label_seg *seg;
+
+	while (l->stream_seg < l->nseg) {
+		seg=&l->seg[l->stream_seg];
+		/* render this one and the next few at once */
+		if ((seg->bm == NULL) && (l->pool != NULL)) {
+			label_render_ahead(l, l->stream_seg, l->stream_seg + (l->pool->started + 1) * LABEL_AHEAD);
+		}
+		if (label_render_seg(l, seg) != 0) {
+			return -1;
+		}
+		if (l->stream_x < seg->bm->width) {
+			return 1;
+		}
+		label_release_seg(seg);
+		l->stream_seg++;
+		l->stream_x=0;
+	}
+	return 0;
+}
+
+/* Fill the next raster line of the label, see ptouch_label_ready().
+   Returns 1 for a line, 0 at the end of the label and -1 on errors. */
+int ptouch_label_next_rasterline(pt_label l, uint8_t *line, size_t bpl, int offset)
+{
+	struct _pt_label_seg *seg;
+	int r;
+
+	if ((r=ptouch_label_ready(l)) <= 0) {
+		return r;
+	}
+	seg=&l->seg[l->stream_seg];
+	if (ptouch_bitmap_rasterline(seg->bm, l->stream_x++, line, bpl, offset + l->height - seg->bm->height) != 0) {
+		return -1;
+	}
+	return 1;
+}
+
+/* index of the segment holding column x, or -1 */
+static int label_find(pt_label l, int x)
+{
+	int lo=0, hi=l->nseg - 1;
+
+	if ((x < 0) || (x >= l->width)) {
+		return -1;
+	}
+	/* columns are usually asked for in order */
+	if ((l->cur < l->nseg) && (x >= l->seg[l->cur].x)) {
+		if (x < l->seg[l->cur].x + l->seg[l->cur].bm->width) {
+			return l->cur;
+		}
+		if ((l->cur + 1 < l->nseg) && (x < l->seg[l->cur + 1].x + l->seg[l->cur + 1].bm->width)) {
+			return ++l->cur;
+		}
+	}
+	while (lo < hi) {
+		int mid=(lo + hi + 1) / 2;
+		if (l->seg[mid].x <= x) {
+			lo=mid;
+		} else {
+			hi=mid - 1;
+		}
+	}
+	l->cur=lo;
+	return lo;
+}
+
+/* Fill a raster line from column x of the label without materializing it.
+   Segments are top aligned, as if they were copied into one image of
+   the label's height. Only works once all segments are rendered. */
+int ptouch_label_rasterline(pt_label l, int x, uint8_t *line, size_t bpl, int offset)
+{
+	int i;
+	pt_bitmap bm;
+
+	if ((l->lazy > 0) || ((i=label_find(l, x)) < 0)) {
+		return -1;
+	}
+	bm=l->seg[i].bm;
+	return ptouch_bitmap_rasterline(bm, x - l->seg[i].x, line, bpl, offset + l->height - bm->height);
+}
+
+/* copy all segments into one bitmap, rendering lazy ones on the way */
+pt_bitmap ptouch_label_render(pt_label l)
+{
+	pt_bitmap out;
+
+	if (l == NULL) {
+		return NULL;
+	}
+	if (l->lazy > 0) {
+		label_render_ahead(l, 0, l->nseg);
+		l->width=0;
+		for (int i=0; i < l->nseg; i++) {
+			if (label_render_seg(l, &l->seg[i]) != 0) {
+				return NULL;
+			}
+			l->seg[i].x=l->width;
+			l->width+=l->seg[i].bm->width;
+			if (l->seg[i].render != NULL) {
+				l->seg[i].render=NULL;	/* keep the bitmap from now on */
+				l->lazy--;
+			}
+		}
+	}
+	if ((l->width == 0) || (l->height == 0)) {
+		return NULL;
+	}
+	if ((out=ptouch_bitmap_new(l->width, l->height)) == NULL) {
+		return NULL;
+	}
+	for (int i=0; i < l->nseg; i++) {
+		ptouch_bitmap_blit(out, l->seg[i].x, 0, l->seg[i].bm);
+	}
+	return out;
+}
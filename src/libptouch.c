@@ -17,7 +17,7 @@
 	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
-#define _POSIX_C_SOURCE	199309L	/* needed for nanosleep() when using -std=c11 */
+#define _POSIX_C_SOURCE	199309L	/* needed for clock_gettime() when using -std=c11 */
 
 #ifndef USING_CMAKE
 #include "config.h"
@@ -29,11 +29,14 @@
 #include <sys/types.h>	/* open() */
 #include <sys/stat.h>	/* open() */
 #include <fcntl.h>	/* open() */
-#include <time.h>	/* nanosleep(), struct timespec */
-#include "gettext.h"	/* gettext(), ngettext() */
+#include <time.h>	/* clock_gettime(), struct timespec */
+#include <sys/time.h>	/* struct timeval */
+#include <pthread.h>
+#include "gettext.h"	/* dgettext() */
 #include "ptouch.h"
 
-#define _(s) gettext(s)
+/* the library translates from its own domain, whatever the program uses */
+#define _(s) dgettext(PACKAGE, s)
 
 /* Print area width in 180 DPI pixels */
 struct _pt_tape_info tape_info[]= {
@@ -46,8 +49,12 @@ struct _pt_tape_info tape_info[]= {
 	{ 0, 0}		/* terminating entry */
 };
 
+/* keep sorted by vid and pid, ptouch_lookup() does a binary search */
+/* FLAG_RASTER_EMPTY only where the raster command reference documents
+   the 5A (Z) command, a printer that does not know it prints garbage */
 struct _pt_dev_info ptdevs[] = {
 	{0x04f9, 0x2007, "PT-2420PC", 180, 16, FLAG_RASTER_PACKBITS},	/* 180dpi, 128px, maximum tape width 24mm, must send TIFF compressed pixel data */
+	{0x04f9, 0x200d, "PT-3600", 360, 48, FLAG_RASTER_PACKBITS},
 	{0x04f9, 0x202c, "PT-1230PC", 180, 16, FLAG_NONE},		/* 180dpi, supports tapes up to 12mm - I don't know how much pixels it can print! */
 	/* Notes about the PT-1230PC: While it is true that this printer supports
 	   max 12mm tapes, it apparently expects > 76px data - the first 32px
@@ -58,119 +65,1031 @@ struct _pt_dev_info ptdevs[] = {
 	{0x04f9, 0x2041, "PT-2730", 180, 16, FLAG_NONE},		/* 180dpi, maximum 128px, max tape width 24mm - reported to work with some quirks */
 	/* Notes about the PT-2730: was reported to need 48px whitespace
 	   within png-images before content is actually printed - can not check this */
-	{0x04f9, 0x205f, "PT-E500", 180, 16, FLAG_RASTER_PACKBITS},
+	{0x04f9, 0x205f, "PT-E500", 180, 16, FLAG_RASTER_PACKBITS|FLAG_RASTER_EMPTY},
 	/* Note about the PT-E500: was reported by Jesse Becker with the
 	   remark that it also needs some padding (white pixels) */
-	{0x04f9, 0x2061, "PT-P700", 180, 16, FLAG_RASTER_PACKBITS|FLAG_P700_INIT},
+	{0x04f9, 0x2061, "PT-P700", 180, 16, FLAG_RASTER_PACKBITS|FLAG_RASTER_EMPTY|FLAG_P700_INIT},
 	{0x04f9, 0x2064, "PT-P700 (PLite Mode)", 128, 16, FLAG_PLITE},
 	{0x04f9, 0x2073, "PT-D450", 180, 16, FLAG_RASTER_PACKBITS},
-	{0x04f9, 0x200d, "PT-3600", 360, 48, FLAG_RASTER_PACKBITS},
 	/* Notes about the PT-D450: I'm unsure if print width really is 128px */
 	{0, 0, "", 0, 0, 0}
 };
 
 void ptouch_rawstatus(uint8_t raw[32]);
+int ptouch_find_endpoints(ptouch_dev ptdev);
 
-int ptouch_open(ptouch_dev *ptdev)
+/* look up the bulk endpoints of interface 0 and the OUT endpoint's packet
+   size instead of assuming 0x02/0x81, then size the command buffer from it */
+int ptouch_find_endpoints(ptouch_dev ptdev)
 {
-	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle = NULL;
-	struct libusb_device_descriptor desc;
-	ssize_t cnt;
-	int r,i=0;
+	struct libusb_config_descriptor *cfg;
+	const struct libusb_interface_descriptor *ifd;
+	int r;
+
+	ptdev->ep_out=0x02;
+	ptdev->ep_in=0x81;
+	ptdev->max_packet=64;
+	if ((r=libusb_get_active_config_descriptor(libusb_get_device(ptdev->h), &cfg)) != 0) {
+		fprintf(stderr, _("failed to get config descriptor: %s\n"), libusb_error_name(r));
+	} else {
+		if ((cfg->bNumInterfaces > 0) && (cfg->interface[0].num_altsetting > 0)) {
+			ifd=&cfg->interface[0].altsetting[0];
+			for (int i=0; i<ifd->bNumEndpoints; i++) {
+				const struct libusb_endpoint_descriptor *ep=&ifd->endpoint[i];
+				if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK) {
+					continue;
+				}
+				if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+					ptdev->ep_in=ep->bEndpointAddress;
+				} else {
+					ptdev->ep_out=ep->bEndpointAddress;
+					ptdev->max_packet=ep->wMaxPacketSize & 0x7ff;
+				}
+			}
+		}
+		libusb_free_config_descriptor(cfg);
+	}
+	if (ptdev->max_packet == 0) {
+		ptdev->max_packet=64;
+	}
+	ptdev->xfers=NULL;
+	ptdev->nxfers=0;
+	ptdev->status_timeout=PTOUCH_STATUS_TIMEOUT;
+	memset(&ptdev->xstats, 0, sizeof(ptdev->xstats));
+	return ptouch_set_queue_depth(ptdev, PTOUCH_QUEUE_DEPTH);
+}
+
+static double elapsed(struct timespec *since)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)(ts.tv_sec - since->tv_sec) + (double)(ts.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void LIBUSB_CALL ptouch_xfer_done(struct libusb_transfer *t)
+{
+	struct _pt_xfer *x=t->user_data;
+	ptouch_dev ptdev=x->ptdev;
+	struct _pt_xfer_stats *st=&ptdev->xstats;
+	double lat=elapsed(&x->submitted);
+
+	x->busy=0;
+	ptdev->inflight--;
+	st->completed++;
+	st->latency_sum+=lat;
+	if ((st->latency_min == 0) || (lat < st->latency_min)) {
+		st->latency_min=lat;
+	}
+	if (lat > st->latency_max) {
+		st->latency_max=lat;
+	}
+	if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+		fprintf(stderr, _("write error: transfer status %i\n"), t->status);
+		ptdev->tx_error=-1;
+	} else if (t->actual_length != t->length) {
+		fprintf(stderr, _("write error: could send only %i of %i bytes\n"), t->actual_length, t->length);
+		ptdev->tx_error=-1;
+	}
+	st->bytes+=(size_t)t->actual_length;
+}
+
+/* run the libusb event loop until at most max transfers are in flight */
+static int ptouch_wait_inflight(ptouch_dev ptdev, int max)
+{
+	int r;
+
+	while (ptdev->inflight > max) {
+		if ((r=libusb_handle_events_completed(ptdev->ctx, NULL)) != 0) {
+			fprintf(stderr, _("error while handling USB events: %s\n"), libusb_error_name(r));
+			return -1;
+		}
+	}
+	return ptdev->tx_error;
+}
+
+/* hand the buffer filled by ptouch_send() to libusb and move on to the
+   next free slot, waiting only if all slots are still on the wire */
+static int ptouch_usb_write(ptouch_dev ptdev, uint8_t *data, size_t len)
+{
+	struct _pt_xfer *x=&ptdev->xfers[ptdev->cur];
+	int r;
+
+	/* let the status monitor see what the printer said so far */
+	if (ptdev->mon_active) {
+		struct timeval tv={ 0, 0 };
+		libusb_handle_events_timeout_completed(ptdev->ctx, &tv, NULL);
+		if (ptdev->tx_error != 0) {
+			return -1;
+		}
+	}
+	libusb_fill_bulk_transfer(x->t, ptdev->h, ptdev->ep_out, data, (int)len, ptouch_xfer_done, x, 0);
+	clock_gettime(CLOCK_MONOTONIC, &x->submitted);
+	if ((r=libusb_submit_transfer(x->t)) != 0) {
+		fprintf(stderr, _("write error: %s\n"), libusb_error_name(r));
+		return -1;
+	}
+	x->busy=1;
+	ptdev->inflight++;
+	ptdev->xstats.submitted++;
+	if (ptdev->inflight > ptdev->xstats.max_inflight) {
+		ptdev->xstats.max_inflight=ptdev->inflight;
+	}
+	ptdev->cur=(ptdev->cur + 1) % ptdev->nxfers;
+	ptdev->txbuf=ptdev->xfers[ptdev->cur].buf;
+	/* slots are reused in order, so the next one is free once at most
+	   nxfers-1 transfers are pending */
+	while (ptdev->xfers[ptdev->cur].busy) {
+		if (ptouch_wait_inflight(ptdev, ptdev->inflight - 1) != 0) {
+			return -1;
+		}
+	}
+	return ptdev->tx_error;
+}
 
-	if ((*ptdev=malloc(sizeof(struct _ptouch_dev))) == NULL) {
+static int ptouch_usb_read(ptouch_dev ptdev, uint8_t *buf, size_t len, unsigned int timeout_ms)
+{
+	int r, tx=0;
+
+	r=libusb_bulk_transfer(ptdev->h, ptdev->ep_in, buf, (int)len, &tx, timeout_ms);
+	if ((r != 0) && (r != LIBUSB_ERROR_TIMEOUT)) {
+		fprintf(stderr, _("read error: %s\n"), libusb_error_name(r));
+		return -1;
+	}
+	return tx;
+}
+
+static void ptouch_hotplug_unref(pt_hotplug hp);
+
+static void ptouch_usb_close(ptouch_dev ptdev)
+{
+	libusb_release_interface(ptdev->h, 0);
+	libusb_close(ptdev->h);
+	if (ptdev->hp != NULL) {
+		ptouch_hotplug_unref(ptdev->hp);
+	} else {
+		libusb_exit(ptdev->ctx);
+	}
+}
+
+const struct _pt_transport_ops ptouch_usb_ops={ ptouch_usb_write, ptouch_usb_read, ptouch_usb_close };
+
+/* pass what ptouch_send() has queued on to the transport */
+static int ptouch_submit(ptouch_dev ptdev)
+{
+	int r;
+
+	if (ptdev->txlen == 0) {
+		return ptdev->tx_error;
+	}
+	r=ptdev->ops->write(ptdev, ptdev->txbuf, ptdev->txlen);
+	ptdev->txlen=0;
+	return r;
+}
+
+/* (re)allocate n transfer slots, each holding PTOUCH_TX_PACKETS packets.
+   The new ring is complete before the old one is freed, so on errors
+   ptdev keeps the slots it had. */
+int ptouch_set_queue_depth(ptouch_dev ptdev, int n)
+{
+	struct _pt_xfer *xfers;
+	size_t txsize=ptdev->max_packet * PTOUCH_TX_PACKETS;
+
+	if (n < 1) {
+		n=1;
+	}
+	if (ptouch_flush(ptdev) != 0) {
+		return -1;
+	}
+	if ((xfers=calloc((size_t)n, sizeof(struct _pt_xfer))) == NULL) {
 		fprintf(stderr, _("out of memory\n"));
 		return -1;
 	}
-	if (((*ptdev)->devinfo=malloc(sizeof(struct _pt_dev_info))) == NULL) {
+	for (int i=0; i<n; i++) {
+		xfers[i].ptdev=ptdev;
+		xfers[i].t=libusb_alloc_transfer(0);
+		xfers[i].buf=malloc(txsize);
+		if ((xfers[i].t == NULL) || (xfers[i].buf == NULL)) {
+			fprintf(stderr, _("out of memory\n"));
+			for (int k=0; k<=i; k++) {
+				libusb_free_transfer(xfers[k].t);
+				free(xfers[k].buf);
+			}
+			free(xfers);
+			return -1;
+		}
+	}
+	for (int i=0; i<ptdev->nxfers; i++) {
+		libusb_free_transfer(ptdev->xfers[i].t);
+		free(ptdev->xfers[i].buf);
+	}
+	free(ptdev->xfers);
+	ptdev->xfers=xfers;
+	ptdev->nxfers=n;
+	ptdev->cur=0;
+	ptdev->inflight=0;
+	ptdev->tx_error=0;
+	ptdev->txlen=0;
+	ptdev->txsize=txsize;
+	ptdev->txbuf=xfers[0].buf;
+	return 0;
+}
+
+int ptouch_get_queue_depth(ptouch_dev ptdev)
+{
+	return ptdev->nxfers;
+}
+
+void ptouch_set_status_timeout(ptouch_dev ptdev, unsigned int ms)
+{
+	ptdev->status_timeout=(ms > 0) ? ms : PTOUCH_STATUS_TIMEOUT;
+}
+
+/* --------------------------------------------------------------------
+	Status monitor: while a job is sent, a read on ep_in stays
+	submitted and picks up the status the printer sends on its own
+	(phase changes, errors). It runs from the same event loop as the
+	raster transfers, so no thread is needed. An error makes every
+	further ptouch_send() fail, so a job stops as soon as the printer
+	reports e.g. the end of the tape or an open cover.
+   -------------------------------------------------------------------- */
+static void LIBUSB_CALL ptouch_monitor_done(struct libusb_transfer *t)
+{
+	ptouch_dev ptdev=t->user_data;
+	uint8_t *buf=ptdev->mon_buf;
+
+	if ((t->status == LIBUSB_TRANSFER_COMPLETED) && (t->actual_length == 32) && (buf[0] == 0x80) && (buf[1] == 0x20)) {
+		memcpy(ptdev->status, buf, 32);
+		/* status type 0x02 is "error occurred", 0x04 "turned off" */
+		if ((ptdev->status->error != 0) || (ptdev->status->status_type == 0x02) || (ptdev->status->status_type == 0x04)) {
+			ptdev->mon_error=(ptdev->status->error != 0) ? ptdev->status->error : -1;
+			ptdev->tx_error=-1;
+		}
+	} else if ((t->status != LIBUSB_TRANSFER_COMPLETED) && (t->status != LIBUSB_TRANSFER_CANCELLED)
+		&& (t->status != LIBUSB_TRANSFER_TIMED_OUT)) {
+		ptdev->mon_active=0;	/* e.g. unplugged, the raster transfers will fail too */
+		return;
+	}
+	if (ptdev->mon_stop || (t->status == LIBUSB_TRANSFER_CANCELLED) || (libusb_submit_transfer(t) != 0)) {
+		ptdev->mon_active=0;
+	}
+}
+
+int ptouch_monitor_start(ptouch_dev ptdev)
+{
+	int r;
+
+	/* only a printer on USB has anything to say on its own */
+	if (ptdev->mon_active || (ptdev->h == NULL)) {
+		return 0;
+	}
+	if ((ptdev->mon == NULL) && ((ptdev->mon=libusb_alloc_transfer(0)) == NULL)) {
 		fprintf(stderr, _("out of memory\n"));
 		return -1;
 	}
-	if (((*ptdev)->status=malloc(sizeof(struct _ptouch_stat))) == NULL) {
+	if (ptdev->mon_error != 0) {
+		ptdev->tx_error=0;	/* that was the printer, not the link */
+	}
+	ptdev->mon_error=0;
+	ptdev->mon_stop=0;
+	libusb_fill_bulk_transfer(ptdev->mon, ptdev->h, ptdev->ep_in, ptdev->mon_buf, sizeof(ptdev->mon_buf),
+		ptouch_monitor_done, ptdev, 0);
+	if ((r=libusb_submit_transfer(ptdev->mon)) != 0) {
+		fprintf(stderr, _("could not start status monitor: %s\n"), libusb_error_name(r));
+		return -1;
+	}
+	ptdev->mon_active=1;
+	return 0;
+}
+
+/* cancel the monitor's read and wait until it is back */
+int ptouch_monitor_stop(ptouch_dev ptdev)
+{
+	int r;
+
+	if (!ptdev->mon_active) {
+		return 0;
+	}
+	ptdev->mon_stop=1;
+	libusb_cancel_transfer(ptdev->mon);
+	while (ptdev->mon_active) {
+		if ((r=libusb_handle_events_completed(ptdev->ctx, NULL)) != 0) {
+			fprintf(stderr, _("error while handling USB events: %s\n"), libusb_error_name(r));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* error bits the printer reported since ptouch_monitor_start(), 0 if none */
+int ptouch_monitor_error(ptouch_dev ptdev)
+{
+	return ptdev->mon_error;
+}
+
+struct _pt_xfer_stats *ptouch_get_xfer_stats(ptouch_dev ptdev)
+{
+	return &ptdev->xstats;
+}
+
+/* index of the ptdevs[] entry for a device, -1 if it is not a P-Touch */
+static int ptouch_lookup(struct libusb_device_descriptor *desc)
+{
+	uint32_t id=((uint32_t)desc->idVendor << 16) | desc->idProduct;
+	int lo=0, hi=(int)(sizeof(ptdevs) / sizeof(ptdevs[0])) - 2;	/* without the terminating entry */
+
+	while (lo <= hi) {
+		int mid=(lo + hi) / 2;
+		uint32_t k=((uint32_t)ptdevs[mid].vid << 16) | ptdevs[mid].pid;
+		if (k == id) {
+			return (ptdevs[mid].flags >= 0) ? mid : -1;
+		}
+		if (k < id) {
+			lo=mid + 1;
+		} else {
+			hi=mid - 1;
+		}
+	}
+	return -1;
+}
+
+/* tell the user why a printer can not be used, 0 if it can */
+static int ptouch_unusable(int k)
+{
+	if (ptdevs[k].flags & FLAG_PLITE) {
+		printf("Printer is in P-Lite Mode, which is unsupported\n\n");
+		printf("Turn off P-Lite mode by changing switch from position EL to position E\n");
+		printf("or by pressing the PLite button for ~ 2 seconds (or consult the manual)\n");
+		return -1;
+	}
+	if (ptdevs[k].flags & FLAG_UNSUP_RASTER) {
+		printf("Unfortunately, that printer currently is unsupported (it has a different raster data transfer)\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Parse a printer selector, one of
+		<bus>:<address>			as shown by lsusb, e.g. 1:5
+		<bus>-<port>[.<port>...]	port path as in sysfs, e.g. 1-2.3
+		serial=<iSerial>
+	The port path stays the same when a printer is plugged in again,
+	the address does not. sel->serial points into spec.
+	Returns 0, or -1 if spec is none of these.
+   -------------------------------------------------------------------- */
+int ptouch_parse_selector(const char *spec, pt_selector sel)
+{
+	char *end;
+	long n;
+
+	memset(sel, 0, sizeof(*sel));
+	sel->bus=-1;
+	sel->addr=-1;
+	if (strncmp(spec, "serial=", 7) == 0) {
+		sel->serial=spec + 7;
+		return (*sel->serial != '\0') ? 0 : -1;
+	}
+	n=strtol(spec, &end, 10);
+	if ((end == spec) || (n < 0) || (n > 255)) {
+		return -1;
+	}
+	sel->bus=(int)n;
+	if (*end == ':') {
+		spec=end + 1;
+		n=strtol(spec, &end, 10);
+		if ((end == spec) || (*end != '\0') || (n < 0) || (n > 255)) {
+			return -1;
+		}
+		sel->addr=(int)n;
+		return 0;
+	}
+	if (*end != '-') {
+		return -1;
+	}
+	do {
+		spec=end + 1;
+		n=strtol(spec, &end, 10);
+		if ((end == spec) || (n < 0) || (n > 255) || (sel->nports == (int)sizeof(sel->port))) {
+			return -1;
+		}
+		sel->port[sel->nports++]=(uint8_t)n;
+	} while (*end == '.');
+	return (*end == '\0') ? 0 : -1;
+}
+
+/* does dev sit where sel says, the serial number is checked later */
+static int ptouch_match(libusb_device *dev, pt_selector sel)
+{
+	uint8_t port[sizeof(sel->port)];
+	int n;
+
+	if (sel == NULL) {
+		return 1;
+	}
+	if ((sel->bus >= 0) && (libusb_get_bus_number(dev) != sel->bus)) {
+		return 0;
+	}
+	if ((sel->addr >= 0) && (libusb_get_device_address(dev) != sel->addr)) {
+		return 0;
+	}
+	if (sel->nports > 0) {
+		n=libusb_get_port_numbers(dev, port, (int)sizeof(port));
+		if ((n != sel->nports) || (memcmp(port, sel->port, (size_t)n) != 0)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* compare the iSerial string of an opened device */
+static int ptouch_match_serial(libusb_device_handle *handle, struct libusb_device_descriptor *desc, pt_selector sel)
+{
+	unsigned char serial[128];
+
+	if ((desc->iSerialNumber == 0) || (libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber, serial, sizeof(serial)) < 0)) {
+		return 0;
+	}
+	return strcmp((char *)serial, sel->serial) == 0;
+}
+
+/* a device with nothing attached yet */
+static ptouch_dev ptouch_dev_new(void)
+{
+	ptouch_dev ptdev;
+
+	if (((ptdev=calloc(1, sizeof(struct _ptouch_dev))) == NULL)
+		|| ((ptdev->devinfo=malloc(sizeof(struct _pt_dev_info))) == NULL)
+		|| ((ptdev->status=malloc(sizeof(struct _ptouch_stat))) == NULL)) {
 		fprintf(stderr, _("out of memory\n"));
+		if (ptdev != NULL) {
+			free(ptdev->devinfo);
+			free(ptdev);
+		}
+		return NULL;
+	}
+	return ptdev;
+}
+
+/* everything ptouch_dev_new() and the open functions allocated */
+static void ptouch_dev_free(ptouch_dev ptdev)
+{
+	libusb_free_transfer(ptdev->mon);
+	for (int i=0; i<ptdev->nxfers; i++) {
+		libusb_free_transfer(ptdev->xfers[i].t);
+		free(ptdev->xfers[i].buf);
+	}
+	free(ptdev->xfers);
+	free(ptdev->rec);
+	free(ptdev->devinfo);
+	free(ptdev->status);
+	free(ptdev);
+}
+
+/* claim dev, which is printer k of ptdevs[], opening it unless handle
+   already is. ptdev->ctx has to be set, it is left to the caller if
+   this fails before ptdev->ops is set. */
+static int ptouch_open_dev(ptouch_dev ptdev, libusb_device *dev, int k, libusb_device_handle *handle)
+{
+	int r;
+
+	if ((handle == NULL) && ((r=libusb_open(dev, &handle)) != 0)) {
+		fprintf(stderr, _("libusb_open error :%s\n"), libusb_error_name(r));
+		return -1;
+	}
+	ptdev->bus=libusb_get_bus_number(dev);
+	ptdev->addr=libusb_get_device_address(dev);
+	if ((r=libusb_kernel_driver_active(handle, 0)) == 1) {
+		if ((r=libusb_detach_kernel_driver(handle, 0)) != 0) {
+			fprintf(stderr, _("error while detaching kernel driver: %s\n"), libusb_error_name(r));
+		}
+	}
+	if ((r=libusb_claim_interface(handle, 0)) != 0) {
+		fprintf(stderr, _("interface claim error: %s\n"), libusb_error_name(r));
+		libusb_close(handle);
 		return -1;
 	}
-	if ((libusb_init(NULL)) < 0) {
+	ptdev->ops=&ptouch_usb_ops;
+	ptdev->h=handle;
+	ptdev->devinfo->vid=ptdevs[k].vid;
+	ptdev->devinfo->pid=ptdevs[k].pid;
+	ptdev->devinfo->name=ptdevs[k].name;
+	ptdev->devinfo->dpi=ptdevs[k].dpi;
+	ptdev->devinfo->bytes_per_line=ptdevs[k].bytes_per_line;
+	ptdev->devinfo->flags=ptdevs[k].flags;
+	return ptouch_find_endpoints(ptdev);
+}
+
+/* Open the first supported printer that matches sel, any if sel is NULL.
+   Every device gets a libusb context of its own, so several printers
+   can be driven from different threads without sharing an event loop. */
+static int ptouch_open_usb(ptouch_dev ptdev, pt_selector sel)
+{
+	libusb_context *ctx=NULL;
+	libusb_device **devs;
+	libusb_device *dev;
+	libusb_device_handle *handle = NULL;
+	struct libusb_device_descriptor desc;
+	ssize_t cnt;
+	int r,i=0,k;
+
+	if ((libusb_init(&ctx)) < 0) {
 		fprintf(stderr, _("libusb_init() failed\n"));
 		return -1;
 	}
-//	libusb_set_debug(NULL, 3);
-	if ((cnt=libusb_get_device_list(NULL, &devs)) < 0) {
+//	libusb_set_debug(ctx, 3);
+	if ((cnt=libusb_get_device_list(ctx, &devs)) < 0) {
+		libusb_exit(ctx);
 		return -1;
 	}
 	while ((dev=devs[i++]) != NULL) {
+		/* where a device sits is known without asking it */
+		if (!ptouch_match(dev, sel)) {
+			continue;
+		}
 		if ((r=libusb_get_device_descriptor(dev, &desc)) < 0) {
 			fprintf(stderr, _("failed to get device descriptor"));
 			libusb_free_device_list(devs, 1);
+			libusb_exit(ctx);
 			return -1;
 		}
-		for (int k=0; ptdevs[k].vid > 0; k++) {
-			if ((desc.idVendor == ptdevs[k].vid) && (desc.idProduct == ptdevs[k].pid) && (ptdevs[k].flags >= 0)) {
-				fprintf(stderr, _("%s found on USB bus %d, device %d\n"),
-					ptdevs[k].name,
-					libusb_get_bus_number(dev),
-					libusb_get_device_address(dev));
-				if (ptdevs[k].flags & FLAG_PLITE) {
-					printf("Printer is in P-Lite Mode, which is unsupported\n\n");
-					printf("Turn off P-Lite mode by changing switch from position EL to position E\n");
-					printf("or by pressing the PLite button for ~ 2 seconds (or consult the manual)\n");
-					return -1;
-				}
-				if (ptdevs[k].flags & FLAG_UNSUP_RASTER) {
-					printf("Unfortunately, that printer currently is unsupported (it has a different raster data transfer)\n");
-					return -1;
-				}
-				if ((r=libusb_open(dev, &handle)) != 0) {
-					fprintf(stderr, _("libusb_open error :%s\n"), libusb_error_name(r));
-					return -1;
-				}
-				libusb_free_device_list(devs, 1);
-				if ((r=libusb_kernel_driver_active(handle, 0)) == 1) {
-					if ((r=libusb_detach_kernel_driver(handle, 0)) != 0) {
-						fprintf(stderr, _("error while detaching kernel driver: %s\n"), libusb_error_name(r));
-					}
-				}
-				if ((r=libusb_claim_interface(handle, 0)) != 0) {
-					fprintf(stderr, _("interface claim error: %s\n"), libusb_error_name(r));
-					return -1;
-				}
-				(*ptdev)->h=handle;
-				(*ptdev)->devinfo->dpi=ptdevs[k].dpi;
-				(*ptdev)->devinfo->bytes_per_line=ptdevs[k].bytes_per_line;
-				(*ptdev)->devinfo->flags=ptdevs[k].flags;
-				return 0;
+		if ((k=ptouch_lookup(&desc)) < 0) {
+			continue;
+		}
+		handle=NULL;
+		/* the serial number has to be read from the device itself */
+		if ((sel != NULL) && (sel->serial != NULL)) {
+			if (libusb_open(dev, &handle) != 0) {
+				continue;
+			}
+			if (!ptouch_match_serial(handle, &desc, sel)) {
+				libusb_close(handle);
+				continue;
+			}
+		}
+		fprintf(stderr, _("%s found on USB bus %d, device %d\n"),
+			ptdevs[k].name,
+			libusb_get_bus_number(dev),
+			libusb_get_device_address(dev));
+		if (ptouch_unusable(k) != 0) {
+			if (handle != NULL) {
+				libusb_close(handle);
 			}
+			libusb_free_device_list(devs, 1);
+			libusb_exit(ctx);
+			return -1;
+		}
+		ptdev->ctx=ctx;
+		r=ptouch_open_dev(ptdev, dev, k, handle);
+		libusb_free_device_list(devs, 1);
+		if ((r != 0) && (ptdev->ops == NULL)) {
+			libusb_exit(ctx);
 		}
+		return r;
+	}
+	if (sel == NULL) {
+		fprintf(stderr, _("No P-Touch printer found on USB (remember to put switch to position E)\n"));
+	} else {
+		fprintf(stderr, _("No matching P-Touch printer found on USB\n"));
 	}
-	fprintf(stderr, _("No P-Touch printer found on USB (remember to put switch to position E)\n"));
 	libusb_free_device_list(devs, 1);
+	libusb_exit(ctx);
 	return -1;
 }
 
-int ptouch_close(ptouch_dev ptdev)
+int ptouch_open_sel(ptouch_dev *ptdev, pt_selector sel)
 {
-	libusb_release_interface(ptdev->h, 0);
-	libusb_close(ptdev->h);
+	if ((*ptdev=ptouch_dev_new()) == NULL) {
+		return -1;
+	}
+	if (ptouch_open_usb(*ptdev, sel) != 0) {
+		if ((*ptdev)->ops != NULL) {
+			(*ptdev)->ops->close(*ptdev);
+		}
+		ptouch_dev_free(*ptdev);
+		*ptdev=NULL;
+		return -1;
+	}
 	return 0;
 }
 
-int ptouch_send(ptouch_dev ptdev, uint8_t *data, size_t len)
+int ptouch_open(ptouch_dev *ptdev)
+{
+	return ptouch_open_sel(ptdev, NULL);
+}
+
+/* printable width in pixels of a tape that is mm wide, 0 if unknown */
+static int ptouch_tape_px(ptouch_dev ptdev, int mm)
+{
+	for (int i=0; tape_info[i].mm > 0; i++) {
+		if (tape_info[i].mm == mm) {
+			/* DPI calculation ((dpi * mm) / 25.4) */
+			double tape_width = tape_info[i].mm - (tape_info[i].margins * 2);
+			double px = (ptdev->devinfo->dpi * tape_width) / 25.4;
+			return (int)px;
+		}
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Open a printer that is reached through ops instead of USB. It
+	behaves like the printer with product id pid, tp is left to the
+	transport and passed to it as ptdev->tp.
+   -------------------------------------------------------------------- */
+int ptouch_open_transport(ptouch_dev *ptdev, uint16_t pid, const struct _pt_transport_ops *ops, void *tp)
 {
-	int r, tx;
+	int k;
 
-	if ((ptdev == NULL) || (len > 128)) {
+	for (k=0; ptdevs[k].vid > 0; k++) {
+		if (ptdevs[k].pid == pid) {
+			break;
+		}
+	}
+	if (ptdevs[k].vid == 0) {
+		fprintf(stderr, _("unknown printer %04x\n"), pid);
 		return -1;
 	}
-	if ((r=libusb_bulk_transfer(ptdev->h, 0x02, data, (int)len, &tx, 0)) != 0) {
-		fprintf(stderr, _("write error: %s\n"), libusb_error_name(r));
+	if ((*ptdev=ptouch_dev_new()) == NULL) {
+		return -1;
+	}
+	*(*ptdev)->devinfo=ptdevs[k];
+	(*ptdev)->ops=ops;
+	(*ptdev)->tp=tp;
+	(*ptdev)->max_packet=64;
+	(*ptdev)->status_timeout=PTOUCH_STATUS_TIMEOUT;
+	if (ptouch_set_queue_depth(*ptdev, PTOUCH_QUEUE_DEPTH) != 0) {
+		ptouch_dev_free(*ptdev);
+		*ptdev=NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Open every usable printer on the bus. *ptdevs is set to an array
+	of handles that the caller has to free() after closing them.
+	Returns the number of printers opened, -1 on errors.
+   -------------------------------------------------------------------- */
+int ptouch_open_all(ptouch_dev **ptdevs_out)
+{
+	libusb_context *ctx=NULL;
+	libusb_device **devs;
+	struct libusb_device_descriptor desc;
+	struct _pt_selector *where;
+	ssize_t cnt;
+	int n=0, found=0, k;
+
+	*ptdevs_out=NULL;
+	if ((libusb_init(&ctx)) < 0) {
+		fprintf(stderr, _("libusb_init() failed\n"));
+		return -1;
+	}
+	if ((cnt=libusb_get_device_list(ctx, &devs)) < 0) {
+		libusb_exit(ctx);
+		return -1;
+	}
+	if ((where=calloc((size_t)cnt + 1, sizeof(*where))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		libusb_free_device_list(devs, 1);
+		libusb_exit(ctx);
+		return -1;
+	}
+	/* remember where the printers are, each is then opened in its own context */
+	for (ssize_t i=0; i<cnt; i++) {
+		if ((libusb_get_device_descriptor(devs[i], &desc) < 0) || ((k=ptouch_lookup(&desc)) < 0)) {
+			continue;
+		}
+		if (ptouch_unusable(k) != 0) {
+			fprintf(stderr, _("skipping %s on USB bus %d, device %d\n"), ptdevs[k].name,
+				libusb_get_bus_number(devs[i]), libusb_get_device_address(devs[i]));
+			continue;
+		}
+		where[found].bus=libusb_get_bus_number(devs[i]);
+		where[found].addr=libusb_get_device_address(devs[i]);
+		found++;
+	}
+	libusb_free_device_list(devs, 1);
+	libusb_exit(ctx);
+	if (found == 0) {
+		fprintf(stderr, _("No P-Touch printer found on USB (remember to put switch to position E)\n"));
+		free(where);
+		return -1;
+	}
+	if ((*ptdevs_out=calloc((size_t)found, sizeof(ptouch_dev))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		free(where);
+		return -1;
+	}
+	/* a printer that fails to open leaves its slot NULL for the next one */
+	for (int i=0; i<found; i++) {
+		if (ptouch_open_sel(&(*ptdevs_out)[n], &where[i]) == 0) {
+			n++;
+		}
+	}
+	free(where);
+	if (n == 0) {
+		free(*ptdevs_out);
+		*ptdevs_out=NULL;
+		return -1;
+	}
+	return n;
+}
+
+/* --------------------------------------------------------------------
+	Hotplug: instead of enumerating the bus for every open, libusb
+	tells us when a printer comes or goes. Printers that are already
+	plugged in are reported as arriving first. The callback only keeps
+	a reference to the device, ptouch_hotplug_wait() then opens that
+	very device. Printers opened this way share the context of the
+	hotplug, which lives until the last of them is closed. The
+	callback runs in whichever thread handles events on it, so the
+	pending events are kept under a lock.
+   -------------------------------------------------------------------- */
+#define PTOUCH_HOTPLUG_PENDING	16
+
+struct _pt_hotplug {
+	libusb_context *ctx;
+	libusb_hotplug_callback_handle cb;
+	pthread_mutex_t lock;
+	int refs;		/* the hotplug itself and every printer it opened */
+	struct {
+		int event;
+		int k;			/* index in ptdevs[] */
+		libusb_device *dev;	/* referenced until opened, arrivals only */
+		struct _pt_selector where;
+	} pending[PTOUCH_HOTPLUG_PENDING];
+	int head;
+	int len;
+};
+
+static int LIBUSB_CALL ptouch_hotplug_event(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	pt_hotplug hp=user_data;
+	struct libusb_device_descriptor desc;
+	int k, slot;
+
+	(void)ctx;
+	if ((libusb_get_device_descriptor(dev, &desc) < 0) || ((k=ptouch_lookup(&desc)) < 0)) {
+		return 0;
+	}
+	if ((event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) && (ptouch_unusable(k) != 0)) {
+		return 0;
+	}
+	pthread_mutex_lock(&hp->lock);
+	if (hp->len == PTOUCH_HOTPLUG_PENDING) {
+		pthread_mutex_unlock(&hp->lock);
+		fprintf(stderr, _("too many hotplug events, dropping one\n"));
+		return 0;
+	}
+	slot=(hp->head + hp->len++) % PTOUCH_HOTPLUG_PENDING;
+	hp->pending[slot].k=k;
+	hp->pending[slot].dev=NULL;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		hp->pending[slot].event=PT_HOTPLUG_ARRIVED;
+		hp->pending[slot].dev=libusb_ref_device(dev);
+	} else {
+		hp->pending[slot].event=PT_HOTPLUG_LEFT;
+	}
+	memset(&hp->pending[slot].where, 0, sizeof(struct _pt_selector));
+	hp->pending[slot].where.bus=libusb_get_bus_number(dev);
+	hp->pending[slot].where.addr=libusb_get_device_address(dev);
+	pthread_mutex_unlock(&hp->lock);
+	return 0;
+}
+
+pt_hotplug ptouch_hotplug_start(void)
+{
+	pt_hotplug hp;
+	int r;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		fprintf(stderr, _("hotplug is not supported on this system\n"));
+		return NULL;
+	}
+	if ((hp=calloc(1, sizeof(*hp))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		return NULL;
+	}
+	if ((libusb_init(&hp->ctx)) < 0) {
+		fprintf(stderr, _("libusb_init() failed\n"));
+		free(hp);
+		return NULL;
+	}
+	pthread_mutex_init(&hp->lock, NULL);
+	hp->refs=1;
+	/* every printer in ptdevs[] is made by Brother */
+	if ((r=libusb_hotplug_register_callback(hp->ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE, ptdevs[0].vid, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		ptouch_hotplug_event, hp, &hp->cb)) != LIBUSB_SUCCESS) {
+		fprintf(stderr, _("could not register hotplug callback: %s\n"), libusb_error_name(r));
+		ptouch_hotplug_unref(hp);
+		return NULL;
+	}
+	return hp;
+}
+
+/* open the device of an arrival in the context of the hotplug */
+static int ptouch_hotplug_open(pt_hotplug hp, libusb_device *dev, int k, ptouch_dev *ptdev)
+{
+	if ((*ptdev=ptouch_dev_new()) == NULL) {
+		return -1;
+	}
+	fprintf(stderr, _("%s found on USB bus %d, device %d\n"),
+		ptdevs[k].name,
+		libusb_get_bus_number(dev),
+		libusb_get_device_address(dev));
+	pthread_mutex_lock(&hp->lock);
+	hp->refs++;
+	pthread_mutex_unlock(&hp->lock);
+	(*ptdev)->ctx=hp->ctx;
+	(*ptdev)->hp=hp;
+	if (ptouch_open_dev(*ptdev, dev, k, NULL) != 0) {
+		if ((*ptdev)->ops != NULL) {
+			(*ptdev)->ops->close(*ptdev);
+		} else {
+			ptouch_hotplug_unref(hp);
+		}
+		ptouch_dev_free(*ptdev);
+		*ptdev=NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Wait up to timeout_ms for a printer to come or go. Returns
+   PT_HOTPLUG_ARRIVED or PT_HOTPLUG_LEFT with *where set to the
+   printer's bus and address, PT_HOTPLUG_NONE if nothing happened and
+   -1 on errors. A printer that arrived is opened, *ptdev is NULL if
+   that failed. */
+int ptouch_hotplug_wait(pt_hotplug hp, int timeout_ms, pt_selector where, ptouch_dev *ptdev)
+{
+	struct timeval tv={ .tv_sec=timeout_ms / 1000, .tv_usec=(timeout_ms % 1000) * 1000 };
+	libusb_device *dev;
+	int r, event, k, len;
+
+	*ptdev=NULL;
+	pthread_mutex_lock(&hp->lock);
+	len=hp->len;
+	pthread_mutex_unlock(&hp->lock);
+	if (len == 0) {
+		if ((r=libusb_handle_events_timeout_completed(hp->ctx, &tv, NULL)) != 0) {
+			fprintf(stderr, _("error while handling USB events: %s\n"), libusb_error_name(r));
+			return -1;
+		}
+	}
+	pthread_mutex_lock(&hp->lock);
+	if (hp->len == 0) {
+		pthread_mutex_unlock(&hp->lock);
+		return PT_HOTPLUG_NONE;
+	}
+	event=hp->pending[hp->head].event;
+	k=hp->pending[hp->head].k;
+	dev=hp->pending[hp->head].dev;
+	*where=hp->pending[hp->head].where;
+	hp->head=(hp->head + 1) % PTOUCH_HOTPLUG_PENDING;
+	hp->len--;
+	pthread_mutex_unlock(&hp->lock);
+	if (dev != NULL) {
+		ptouch_hotplug_open(hp, dev, k, ptdev);
+		libusb_unref_device(dev);
+	}
+	return event;
+}
+
+/* the context goes when neither the hotplug nor a printer needs it */
+static void ptouch_hotplug_unref(pt_hotplug hp)
+{
+	int refs;
+
+	pthread_mutex_lock(&hp->lock);
+	refs=--hp->refs;
+	pthread_mutex_unlock(&hp->lock);
+	if (refs > 0) {
+		return;
+	}
+	libusb_exit(hp->ctx);
+	pthread_mutex_destroy(&hp->lock);
+	free(hp);
+}
+
+/* no more events, printers opened by the hotplug stay usable */
+void ptouch_hotplug_stop(pt_hotplug hp)
+{
+	if (hp == NULL) {
+		return;
+	}
+	libusb_hotplug_deregister_callback(hp->ctx, hp->cb);
+	pthread_mutex_lock(&hp->lock);
+	for (; hp->len > 0; hp->len--) {
+		if (hp->pending[hp->head].dev != NULL) {
+			libusb_unref_device(hp->pending[hp->head].dev);
+		}
+		hp->head=(hp->head + 1) % PTOUCH_HOTPLUG_PENDING;
+	}
+	pthread_mutex_unlock(&hp->lock);
+	ptouch_hotplug_unref(hp);
+}
+
+int ptouch_close(ptouch_dev ptdev)
+{
+	ptouch_flush(ptdev);
+	ptouch_monitor_stop(ptdev);
+	ptdev->ops->close(ptdev);
+	ptouch_dev_free(ptdev);
+	return 0;
+}
+
+/* submit everything queued by ptouch_send() and wait until all
+   transfers have completed */
+int ptouch_flush(ptouch_dev ptdev)
+{
+	if ((ptdev == NULL) || (ptdev->nxfers == 0)) {
+		return 0;
+	}
+	if (ptouch_submit(ptdev) != 0) {
+		ptouch_wait_inflight(ptdev, 0);
 		return -1;
 	}
-	if (tx != (int)len) {
-		fprintf(stderr, _("write error: could send only %i of %ld bytes\n"), tx, len);
+	return ptouch_wait_inflight(ptdev, 0);
+}
+
+/* keep a copy of everything sent from now on, e.g. to send it again
+   later without rendering the label again */
+void ptouch_record_start(ptouch_dev ptdev)
+{
+	ptdev->recording=1;
+	ptdev->rec_len=0;
+}
+
+/* the data sent since ptouch_record_start(), to be free()d by the
+   caller, or NULL if it did not fit into memory */
+uint8_t *ptouch_record_stop(ptouch_dev ptdev, size_t *len)
+{
+	uint8_t *rec=NULL;
+
+	if (ptdev->recording > 0) {
+		rec=ptdev->rec;
+		*len=ptdev->rec_len;
+	} else {
+		free(ptdev->rec);
+	}
+	ptdev->rec=NULL;
+	ptdev->rec_len=0;
+	ptdev->rec_size=0;
+	ptdev->recording=0;
+	return rec;
+}
+
+static void ptouch_record(ptouch_dev ptdev, uint8_t *data, size_t len)
+{
+	uint8_t *tmp;
+	size_t n;
+
+	if (ptdev->rec_len + len > ptdev->rec_size) {
+		n=(ptdev->rec_size > 0) ? ptdev->rec_size * 2 : 65536;
+		while (n < ptdev->rec_len + len) {
+			n*=2;
+		}
+		if ((tmp=realloc(ptdev->rec, n)) == NULL) {
+			ptdev->recording=-1;
+			return;
+		}
+		ptdev->rec=tmp;
+		ptdev->rec_size=n;
+	}
+	memcpy(ptdev->rec + ptdev->rec_len, data, len);
+	ptdev->rec_len+=len;
+}
+
+/* queue data for the printer, a transfer is submitted as soon as a buffer
+   is full while the next one is being filled */
+int ptouch_send(ptouch_dev ptdev, uint8_t *data, size_t len)
+{
+	size_t n;
+
+	if (ptdev == NULL) {
 		return -1;
 	}
+	ptdev->xstats.commands++;
+	if (ptdev->recording > 0) {
+		ptouch_record(ptdev, data, len);
+	}
+	while (len > 0) {
+		if (ptdev->txlen == ptdev->txsize) {
+			if (ptouch_submit(ptdev) != 0) {
+				return -1;
+			}
+		}
+		n=ptdev->txsize - ptdev->txlen;
+		if (n > len) {
+			n=len;
+		}
+		memcpy(ptdev->txbuf + ptdev->txlen, data, n);
+		ptdev->txlen+=n;
+		data+=n;
+		len-=n;
+	}
 	return 0;
 }
 
@@ -180,6 +1099,29 @@ int ptouch_init(ptouch_dev ptdev)
 	return ptouch_send(ptdev, (uint8_t *)cmd, strlen(cmd));
 }
 
+/* --------------------------------------------------------------------
+	Give up a job that was cut short. What is still queued is dropped,
+	100 zero bytes make the printer discard a half received command
+	(invalidate) and ESC @ puts it back into its initial state. The
+	status monitor has to be stopped first.
+   -------------------------------------------------------------------- */
+int ptouch_reset(ptouch_dev ptdev)
+{
+	uint8_t cmd[102]={ 0 };
+
+	ptdev->txlen=0;
+	ptouch_wait_inflight(ptdev, 0);
+	if (ptdev->mon_error != 0) {
+		ptdev->tx_error=0;	/* that was the printer, not the link */
+	}
+	cmd[100]=0x1b;		/* 1B 40 = ESC @ = INIT */
+	cmd[101]=0x40;
+	if ((ptouch_send(ptdev, cmd, sizeof(cmd)) != 0) || (ptouch_flush(ptdev) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
 int ptouch_enable_packbits(ptouch_dev ptdev)
 {				/* 4D 00 = disable compression */
 	char cmd[] = "M\x02";	/* 4D 02 = enable packbits compression mode */
@@ -230,7 +1172,15 @@ int ptouch_page_flags(ptouch_dev ptdev, uint8_t page_flags)
 int ptouch_eject(ptouch_dev ptdev)
 {
 	char cmd[]="\x1a";
-	return ptouch_send(ptdev, (uint8_t *)cmd, strlen(cmd));
+	int r;
+
+	if (ptouch_send(ptdev, (uint8_t *)cmd, strlen(cmd)) != 0) {
+		ptouch_monitor_stop(ptdev);
+		return -1;
+	}
+	r=ptouch_flush(ptdev);
+	ptouch_monitor_stop(ptdev);
+	return r;
 }
 
 void ptouch_rawstatus(uint8_t raw[32])
@@ -250,20 +1200,27 @@ int ptouch_getstatus(ptouch_dev ptdev)
 {
 	char cmd[]="\x1biS";	/* 1B 69 53 = ESC i S = Status info request */
 	uint8_t buf[32];
-	int i, r, tx=0, tries=0;
-	struct timespec w;
+	int tx=0;
+	struct timespec start;
+	double left;
 
+	/* the reply would go to the monitor otherwise */
+	ptouch_monitor_stop(ptdev);
 	ptouch_send(ptdev, (uint8_t *)cmd, strlen(cmd));
+	if (ptouch_flush(ptdev) != 0) {
+		return -1;
+	}
+	/* the read returns as soon as the reply is there, some printers
+	   send empty packets first, so read again until the deadline */
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	while (tx == 0) {
-		w.tv_sec=0;
-		w.tv_nsec=100000000;	/* 0.1 sec */
-		r=nanosleep(&w, NULL);
-		if ((r=libusb_bulk_transfer(ptdev->h, 0x81, buf, 32, &tx, 0)) != 0) {
-			fprintf(stderr, _("read error: %s\n"), libusb_error_name(r));
+		if ((left=ptdev->status_timeout - elapsed(&start) * 1000) < 1) {
+			left=1;
+		}
+		if ((tx=ptdev->ops->read(ptdev, buf, 32, (unsigned int)left)) < 0) {
 			return -1;
 		}
-		tries++;
-		if (tries > 10) {
+		if ((tx == 0) && (elapsed(&start) * 1000 >= ptdev->status_timeout)) {
 			fprintf(stderr, _("timeout while waiting for status response\n"));
 			return -1;
 		}
@@ -271,16 +1228,7 @@ int ptouch_getstatus(ptouch_dev ptdev)
 	if (tx == 32) {
 		if (buf[0]==0x80 && buf[1]==0x20) {
 			memcpy(ptdev->status, buf, 32);
-			ptdev->tape_width_px=0;
-			for (i=0; tape_info[i].mm > 0; i++) {
-				if (tape_info[i].mm == buf[10]) {
-					/* DPI calculation ((dpi * mm) / 25.4) */
-					double tape_width = tape_info[i].mm - (tape_info[i].margins * 2);
-					double px = (ptdev->devinfo->dpi * tape_width) / 25.4;
-					ptdev->tape_width_px=(int)px;
-				}
-			}
-			if (ptdev->tape_width_px == 0) {
+			if ((ptdev->tape_width_px=ptouch_tape_px(ptdev, buf[10])) == 0) {
 				fprintf(stderr, _("unknown tape width of %imm, please report this.\n"), buf[10]);
 			}
 			return 0;
@@ -297,8 +1245,7 @@ int ptouch_getstatus(ptouch_dev ptdev)
 	fprintf(stderr, _("strange status:\n"));
 	ptouch_rawstatus(buf);
 	fprintf(stderr, _("trying to flush junk\n"));
-	if ((r=libusb_bulk_transfer(ptdev->h, 0x81, buf, 32, &tx, 0)) != 0) {
-		fprintf(stderr, _("read error: %s\n"), libusb_error_name(r));
+	if ((tx=ptdev->ops->read(ptdev, buf, 32, ptdev->status_timeout)) < 0) {
 		return -1;
 	}
 	fprintf(stderr, _("got another %i bytes. now try again\n"), tx);
@@ -315,27 +1262,141 @@ int ptouch_get_tape_pixel_width(ptouch_dev ptdev)
 	return ptdev->tape_width_px;
 }
 
-int ptouch_sendraster(ptouch_dev ptdev, uint8_t *data, size_t len)
+/* length of the run of identical bytes starting at src, at most max bytes;
+   compares a machine word at a time so long blank stretches are cheap */
+static size_t packbits_runlen(const uint8_t *src, size_t max)
 {
-	uint8_t buf[64];
-	int rc;
+	uint64_t pattern, word;
+	size_t n=1;
 
-	if (len > ptdev->devinfo->bytes_per_line) {
-		return -1;
+	pattern=src[0] * UINT64_C(0x0101010101010101);
+	while ((n + sizeof(word)) <= max) {
+		memcpy(&word, src + n, sizeof(word));
+		if (word != pattern) {
+			break;
+		}
+		n+=sizeof(word);
+	}
+	while ((n < max) && (src[n] == src[0])) {
+		n++;
+	}
+	return n;
+}
+
+/* PackBits (TIFF) encoder, dst must hold PACKBITS_MAX_LEN(len) bytes.
+   Runs of identical bytes become repeat runs, a literal run is only
+   interrupted by a run of 3 or more. Returns the encoded length. */
+size_t ptouch_packbits(const uint8_t *src, size_t len, uint8_t *dst)
+{
+	size_t i=0, o=0, hdr, run;
+
+	while (i < len) {
+		run=packbits_runlen(src + i, (len - i) > 128 ? 128 : (len - i));
+		if (run >= 2) {
+			dst[o++]=(uint8_t)(1 - (int)run);	/* -(run-1) */
+			dst[o++]=src[i];
+			i+=run;
+			continue;
+		}
+		hdr=o++;
+		dst[hdr]=0;
+		dst[o++]=src[i++];
+		while ((i < len) && (dst[hdr] < 127)) {
+			if (((len - i) >= 3) && (src[i] == src[i+1]) && (src[i] == src[i+2])) {
+				break;
+			}
+			dst[o++]=src[i++];
+			dst[hdr]++;
+		}
 	}
-	buf[0]=0x47;
+	return o;
+}
+
+/* PackBits decoder, returns the number of bytes written to dst or -1 if
+   src is malformed or does not fit into dstlen bytes */
+ssize_t ptouch_unpackbits(const uint8_t *src, size_t len, uint8_t *dst, size_t dstlen)
+{
+	size_t i=0, o=0, n;
+
+	while (i < len) {
+		int8_t hdr=(int8_t)src[i++];
+		if (hdr >= 0) {
+			n=(size_t)hdr + 1;
+			if ((i + n > len) || (o + n > dstlen)) {
+				return -1;
+			}
+			memcpy(dst + o, src + i, n);
+			i+=n;
+		} else if (hdr != -128) {
+			n=(size_t)(1 - hdr);
+			if ((i >= len) || (o + n > dstlen)) {
+				return -1;
+			}
+			memset(dst + o, src[i++], n);
+		} else {
+			continue;	/* -128 is a no-op */
+		}
+		o+=n;
+	}
+	return (ssize_t)o;
+}
+
+/* encode one raster line, picking whichever of PackBits and a single
+   literal run is shorter. Returns the encoded length. */
+size_t ptouch_encode_rasterline(const uint8_t *data, size_t len, uint8_t *dst)
+{
+	size_t n;
+
+	n=ptouch_packbits(data, len, dst);
+	if (n > len + 1) {
+		/* incompressible - store as one literal run (len <= 128) */
+		dst[0]=(uint8_t)(len - 1);
+		memcpy(dst + 1, data, len);
+		n=len + 1;
+	}
+	return n;
+}
+
+/* 1 if no pixel of a raster line is set */
+static int ptouch_rasterline_empty(const uint8_t *data, size_t len)
+{
+	for (size_t i=0; i<len; i++) {
+		if (data[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* the command that sends one raster line, cmd must have room for
+   PTOUCH_RASTER_CMD_MAX(bytes_per_line) bytes. Returns its length. */
+size_t ptouch_raster_command(ptouch_dev ptdev, const uint8_t *data, size_t len, uint8_t *cmd)
+{
+	size_t n;
+
+	/* padding and blank columns cost one byte instead of a whole line */
+	if ((ptdev->devinfo->flags & FLAG_RASTER_EMPTY) && ptouch_rasterline_empty(data, len)) {
+		cmd[0]=0x5a;
+		return 1;
+	}
+	cmd[0]=0x47;
 	if (ptdev->devinfo->flags & FLAG_RASTER_PACKBITS) {
-		/* Fake compression by encoding a single uncompressed run */
-		buf[1] = (uint8_t)(len + 1);
-		buf[2] = 0;
-		buf[3] = (uint8_t)(len - 1);
-		memcpy(buf + 4, data, len);
-		rc = ptouch_send(ptdev, buf, len + 4);
+		n=ptouch_encode_rasterline(data, len, cmd + 3);
 	} else {
-		buf[1] = (uint8_t)len;
-		buf[2] = 0;
-		memcpy(buf + 3, data, len);
-		rc = ptouch_send(ptdev, buf, len + 3);
+		memcpy(cmd + 3, data, len);
+		n=len;
+	}
+	cmd[1]=(uint8_t)(n & 0xff);
+	cmd[2]=(uint8_t)(n >> 8);
+	return n + 3;
+}
+
+int ptouch_sendraster(ptouch_dev ptdev, uint8_t *data, size_t len)
+{
+	uint8_t buf[PTOUCH_RASTER_CMD_MAX(ptdev->devinfo->bytes_per_line)];
+
+	if (len > ptdev->devinfo->bytes_per_line) {
+		return -1;
 	}
-	return rc;
+	return ptouch_send(ptdev, buf, ptouch_raster_command(ptdev, data, len, buf));
 }
@@ -0,0 +1,464 @@
+/*
+	ptouch-bench - benchmarks for the ptouch render and raster pipeline
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#define _POSIX_C_SOURCE	200809L	/* needed for clock_gettime(), mkstemp() when using -std=c11 */
+
+#include <stdio.h>	/* fprintf() */
+#include <stdlib.h>	/* rand(), strtol(), mkstemp() */
+#include <stdbool.h>
+#include <string.h>	/* memset(), memcmp() */
+#include <time.h>	/* clock_gettime() */
+#include <unistd.h>	/* dup(), unlink() */
+#include <gd.h>
+#include "ptouch.h"
+#include "text.h"
+#include "render.h"
+
+#define LINES 4096	/* raster lines per corpus */
+#define JOB_SEGS 200	/* most segments a corpus job has */
+
+enum corpus_kind { CORPUS_BLANK, CORPUS_TEXT, CORPUS_DENSE };
+
+const char *corpus_name[] = { "blank", "text", "dense" };
+
+/* the corpus of whole jobs, printed to a null device */
+enum job_kind { JOB_SHORT, JOB_LINES, JOB_PNG, JOB_LONG, JOB_CUTMARKS };
+
+const char *job_name[] = { "short_text", "four_lines", "large_png", "label_5m", "cutmarks_200" };
+
+enum stage { ST_RENDER_TEXT, ST_IMAGE_LOAD, ST_CUTMARK, ST_APPEND, ST_RASTER, ST_SEND, NSTAGES };
+
+const char *stage_name[] = { "render_text", "image_load", "img_cutmark", "label_append", "rasterize", "sendraster" };
+
+bool debug=false;
+FILE *json;		/* results, stdout is left to the renderers' chatter */
+char *font="DejaVuSans";
+char png_file[]="/tmp/ptouch-bench-XXXXXX";
+char *long_text;	/* one line of text 5 m long */
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* fill lines with something resembling real labels: all blank, a band of
+   glyph-like strokes in the middle of the tape, or random noise */
+void make_corpus(uint8_t *lines, size_t bpl, enum corpus_kind kind)
+{
+	memset(lines, 0, bpl * LINES);
+	for (size_t l=0; l<LINES; l++) {
+		uint8_t *line=lines + l * bpl;
+		switch (kind) {
+		case CORPUS_BLANK:
+			break;
+		case CORPUS_TEXT:
+			if ((l % 64) < 48) {	/* 16 blank lines between glyphs */
+				for (size_t b=bpl/4; b<bpl-bpl/4; b++) {
+					line[b]=((rand() % 3) == 0) ? 0xff : (uint8_t)(rand() & 0x81);
+				}
+			}
+			break;
+		case CORPUS_DENSE:
+			for (size_t b=0; b<bpl; b++) {
+				line[b]=(uint8_t)rand();
+			}
+			break;
+		}
+	}
+}
+
+/* encode the corpus over and over, then decode it once to make sure the
+   PackBits output reproduces the input exactly */
+int bench_packbits(size_t bpl, enum corpus_kind kind, int rounds, bool first)
+{
+	uint8_t *lines=malloc(bpl * LINES);
+	uint8_t enc[PACKBITS_MAX_LEN(bpl)];
+	uint8_t dec[bpl];
+	size_t packed=0, literal=0;
+	double t;
+	int rc=0;
+
+	if (lines == NULL) {
+		return -1;
+	}
+	make_corpus(lines, bpl, kind);
+	t=now();
+	for (int r=0; r<rounds; r++) {
+		packed=0;
+		for (size_t l=0; l<LINES; l++) {
+			packed+=ptouch_encode_rasterline(lines + l * bpl, bpl, enc) + 3;
+		}
+	}
+	t=now() - t;
+	for (size_t l=0; l<LINES; l++) {
+		size_t n=ptouch_encode_rasterline(lines + l * bpl, bpl, enc);
+		if ((ptouch_unpackbits(enc, n, dec, bpl) != (ssize_t)bpl) || (memcmp(dec, lines + l * bpl, bpl) != 0)) {
+			rc=-1;
+			break;
+		}
+	}
+	literal=(bpl + 4) * LINES;	/* single literal run per line */
+	fprintf(json, "%s    {\"corpus\": \"%s\", \"bytes_per_line\": %zu, \"mb_per_s\": %.1f, "
+		"\"literal_bytes\": %zu, \"packed_bytes\": %zu, \"round_trip\": %s}",
+		first ? "" : ",\n", corpus_name[kind], bpl, (double)(bpl * LINES) * rounds / t / 1e6,
+		literal, packed, (rc == 0) ? "true" : "false");
+	free(lines);
+	return rc;
+}
+
+/* the per pixel conversion print_img() used before ptouch_transpose() */
+void rasterline_setpixel(uint8_t* rasterline, size_t size, int pixel)
+{
+	if (pixel > 384) {
+		return;
+	}
+
+	rasterline[(size - 1)-(pixel/8)] |= (uint8_t)(1<<(pixel%8));
+	return;
+}
+
+void convert_getpixel(gdImage *im, uint8_t *out, size_t bpl, int offset)
+{
+	for (int k=0; k<gdImageSX(im); k++) {
+		uint8_t *rasterline=out + (size_t)k * bpl;
+		memset(rasterline, 0, bpl);
+		for (int i=0; i<gdImageSY(im); i++) {
+			if (gdImageGetPixel(im, k, gdImageSY(im)-1-i) == 1) {
+				rasterline_setpixel(rasterline, bpl, offset+i);
+			}
+		}
+	}
+}
+
+void convert_transpose(gdImage *im, uint8_t *out, size_t bpl, int offset)
+{
+	size_t rowbytes=((size_t)gdImageSX(im) + 7) / 8;
+	uint8_t bits[rowbytes * (size_t)gdImageSY(im)];
+	const uint8_t *rows[gdImageSY(im)];
+	uint8_t cols[8 * bpl];
+
+	for (int i=0; i<gdImageSY(im); i++) {
+		rows[i]=bits + (size_t)i * rowbytes;
+		ptouch_pack_8bpp(bits + (size_t)i * rowbytes, im->pixels[i], gdImageSX(im), 1);
+	}
+	for (int k=0; k<gdImageSX(im); k+=8) {
+		int n=(gdImageSX(im) - k < 8) ? gdImageSX(im) - k : 8;
+		memset(cols, 0, sizeof(cols));
+		ptouch_transpose(cols, bpl, rows, k, n, gdImageSY(im), offset);
+		for (int c=0; c<n; c++) {
+			for (size_t b=0; b<bpl; b++) {
+				out[(size_t)(k + c) * bpl + bpl - 1 - b]=cols[(size_t)c * bpl + b];
+			}
+		}
+	}
+}
+
+/* convert a palette image the old way and with the transpose kernel,
+   check both produce the same raster lines */
+int bench_transpose(size_t bpl, int height, int rounds, bool first)
+{
+	const int width=2000;
+	int offset=(int)(bpl * 8) / 2 - height / 2;
+	uint8_t *ref=malloc(bpl * width);
+	uint8_t *out=malloc(bpl * width);
+	gdImage *im=gdImageCreatePalette(width, height);
+	double t_old, t_new;
+	int rc=0;
+
+	if ((ref == NULL) || (out == NULL) || (im == NULL)) {
+		return -1;
+	}
+	gdImageColorAllocate(im, 255, 255, 255);
+	gdImageColorAllocate(im, 0, 0, 0);
+	for (int y=0; y<height; y++) {
+		for (int x=0; x<width; x++) {
+			if (((x % 64) < 48) && ((rand() % 3) == 0)) {
+				gdImageSetPixel(im, x, y, 1);
+			}
+		}
+	}
+	t_old=now();
+	for (int r=0; r<rounds; r++) {
+		convert_getpixel(im, ref, bpl, offset);
+	}
+	t_old=now() - t_old;
+	t_new=now();
+	for (int r=0; r<rounds; r++) {
+		convert_transpose(im, out, bpl, offset);
+	}
+	t_new=now() - t_new;
+	if (memcmp(ref, out, bpl * width) != 0) {
+		rc=-1;
+	}
+	fprintf(json, "%s    {\"height\": %i, \"getpixel_mpx_per_s\": %.1f, \"transpose_mpx_per_s\": %.1f, "
+		"\"same_output\": %s}", first ? "" : ",\n", height,
+		(double)width * height * rounds / t_old / 1e6,
+		(double)width * height * rounds / t_new / 1e6, (rc == 0) ? "true" : "false");
+	gdImageDestroy(im);
+	free(ref);
+	free(out);
+	return rc;
+}
+
+/* untimed preparation: the PNG for JOB_PNG and the text for JOB_LONG */
+int jobs_setup(ptouch_dev dev)
+{
+	const char *pangram="The quick brown fox jumps over the lazy dog. ";
+	int tape=ptouch_get_tape_pixel_width(dev);
+	int length=(int)(5000.0 / 25.4 * dev->devinfo->dpi);	/* 5 m */
+	struct text_metrics m;
+	char *line[1], *tmp;
+	gdImage *im;
+	FILE *f;
+	int fd, fsz;
+	size_t len;
+
+	if ((fd=mkstemp(png_file)) < 0) {
+		return -1;
+	}
+	if ((f=fdopen(fd, "wb")) == NULL) {
+		close(fd);
+		return -1;
+	}
+	if ((im=gdImageCreatePalette(8000, tape)) == NULL) {
+		fclose(f);
+		return -1;
+	}
+	gdImageColorAllocate(im, 255, 255, 255);
+	gdImageColorAllocate(im, 0, 0, 0);
+	for (int y=0; y<tape; y++) {
+		for (int x=0; x<8000; x++) {
+			if (((x % 64) < 48) && ((rand() % 3) == 0)) {
+				gdImageSetPixel(im, x, y, 1);
+			}
+		}
+	}
+	gdImagePng(im, f);
+	fclose(f);
+	gdImageDestroy(im);
+	/* repeat the pangram until the text is as long as the label */
+	line[0]=(char *)pangram;
+	if ((fsz=text_fit_size(font, line, 1, tape)) < 0) {
+		return -1;
+	}
+	if ((long_text=malloc(strlen(pangram) + 1)) == NULL) {
+		return -1;
+	}
+	strcpy(long_text, pangram);
+	while ((text_measure(font, fsz, long_text, &m) == 0) && (m.width < length)) {
+		len=strlen(long_text);
+		if ((tmp=realloc(long_text, len + strlen(pangram) + 1)) == NULL) {
+			free(long_text);
+			long_text=NULL;
+			return -1;
+		}
+		long_text=tmp;
+		strcpy(long_text + len, pangram);
+	}
+	return 0;
+}
+
+/* produce the bitmaps of one job, timing each kind of segment */
+int job_segments(enum job_kind kind, int tape, pt_bitmap *bm, double *st)
+{
+	char *lines[MAX_LINES]={ "Server room", "Rack 12", "Patch panel B", "Ports 1-24" };
+	char text[32];
+	char *line[1]={ text };
+	double t;
+	int n=0;
+
+	switch (kind) {
+	case JOB_SHORT:
+		t=now();
+		bm[n++]=render_text(font, 0, lines, 1, tape);
+		st[ST_RENDER_TEXT]+=now() - t;
+		break;
+	case JOB_LINES:
+		t=now();
+		bm[n++]=render_text(font, 0, lines, MAX_LINES, tape);
+		st[ST_RENDER_TEXT]+=now() - t;
+		break;
+	case JOB_PNG:
+		t=now();
+		bm[n++]=image_load(png_file);
+		st[ST_IMAGE_LOAD]+=now() - t;
+		break;
+	case JOB_LONG:
+		line[0]=long_text;
+		t=now();
+		bm[n++]=render_text(font, 0, line, 1, tape);
+		st[ST_RENDER_TEXT]+=now() - t;
+		break;
+	case JOB_CUTMARKS:
+		while (n < JOB_SEGS) {
+			snprintf(text, sizeof(text), "Box %i", n / 2 + 1);
+			t=now();
+			bm[n++]=render_text(font, 0, line, 1, tape);
+			st[ST_RENDER_TEXT]+=now() - t;
+			t=now();
+			bm[n++]=img_cutmark(tape);
+			st[ST_CUTMARK]+=now() - t;
+		}
+		break;
+	}
+	for (int i=0; i<n; i++) {
+		if (bm[i] == NULL) {
+			for (int k=0; k<n; k++) {
+				ptouch_bitmap_free(bm[k]);
+			}
+			return -1;
+		}
+	}
+	return n;
+}
+
+/* run a job the way ptouch-print does, but with every stage timed on
+   its own and the printer replaced by the null device */
+int bench_job(ptouch_dev dev, enum job_kind kind, int rounds, bool first)
+{
+	size_t bpl=dev->devinfo->bytes_per_line;
+	int tape=ptouch_get_tape_pixel_width(dev);
+	int offset=(int)(bpl * 8) / 2 - tape / 2;
+	double st[NSTAGES]={ 0 };
+	pt_bitmap bm[JOB_SEGS];
+	pt_label label;
+	uint8_t *lines;
+	size_t bytes=0;
+	unsigned long commands=0;
+	double t;
+	int n, k, nlines=0, rc=0;
+
+	for (int r=0; (r<rounds) && (rc == 0); r++) {
+		if ((n=job_segments(kind, tape, bm, st)) < 0) {
+			rc=-1;
+			break;
+		}
+		t=now();
+		label=ptouch_label_new();
+		for (int i=0; i<n; i++) {
+			ptouch_label_append(label, bm[i]);
+		}
+		st[ST_APPEND]+=now() - t;
+		if ((lines=malloc((size_t)label->width * bpl)) == NULL) {
+			ptouch_label_free(label);
+			rc=-1;
+			break;
+		}
+		t=now();
+		nlines=0;
+		ptouch_label_rewind(label);
+		while ((k=ptouch_label_next_rasterline(label, lines + (size_t)nlines * bpl, bpl, offset)) > 0) {
+			nlines++;
+		}
+		st[ST_RASTER]+=now() - t;
+		bytes=ptouch_get_xfer_stats(dev)->bytes;
+		commands=ptouch_get_xfer_stats(dev)->commands;
+		t=now();
+		ptouch_rasterstart(dev);
+		ptouch_page_flags(dev, AUTO_CUT | FEED_SMALL);
+		for (int i=0; i<nlines; i++) {
+			ptouch_sendraster(dev, lines + (size_t)i * bpl, bpl);
+		}
+		if ((k < 0) || (ptouch_eject(dev) != 0)) {
+			rc=-1;
+		}
+		st[ST_SEND]+=now() - t;
+		bytes=ptouch_get_xfer_stats(dev)->bytes - bytes;
+		commands=ptouch_get_xfer_stats(dev)->commands - commands;
+		free(lines);
+		ptouch_label_free(label);
+	}
+	fprintf(json, "%s    {\"name\": \"%s\", \"ok\": %s, \"lines\": %i, \"bytes\": %zu, \"commands\": %lu, \"stages\": {",
+		first ? "" : ",\n", job_name[kind], (rc == 0) ? "true" : "false", nlines, bytes, commands);
+	k=0;
+	for (int s=0; s<NSTAGES; s++) {
+		if (st[s] == 0) {
+			continue;	/* the job has no such stage */
+		}
+		fprintf(json, "%s\n      \"%s\": {\"seconds\": %.6f", (k++ > 0) ? "," : "", stage_name[s], st[s] / rounds);
+		if ((s == ST_RASTER) || (s == ST_SEND)) {
+			fprintf(json, ", \"lines_per_s\": %.0f", nlines * rounds / st[s]);
+		}
+		if (s == ST_SEND) {
+			fprintf(json, ", \"bytes\": %zu", bytes);
+		}
+		fprintf(json, "}");
+	}
+	fprintf(json, "\n    }}");
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	ptouch_dev dev;
+	int rounds=200, rc=0;
+	bool first=true;
+
+	if (argc > 1) {
+		rounds=strtol(argv[1], NULL, 10);
+	}
+	if (rounds < 1) {
+		rounds=1;
+	}
+	if (argc > 2) {
+		font=argv[2];
+	}
+	/* render_text() tells about the font size it picked on stdout */
+	if ((json=fdopen(dup(1), "w")) == NULL) {
+		return 1;
+	}
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		fprintf(stderr, "could not redirect stdout to /dev/null\n");
+		return 1;
+	}
+	srand(1);
+	fprintf(json, "{\n  \"rounds\": %i,\n  \"packbits\": [\n", rounds);
+	for (size_t bpl=16; bpl<=48; bpl+=32) {
+		for (int k=CORPUS_BLANK; k<=CORPUS_DENSE; k++) {
+			if (bench_packbits(bpl, (enum corpus_kind)k, rounds, first) != 0) {
+				rc=1;
+			}
+			first=false;
+		}
+	}
+	fprintf(json, "\n  ],\n  \"transpose\": [\n");
+	if (bench_transpose(16, 76, rounds / 20 + 1, true) != 0) {
+		rc=1;
+	}
+	if (bench_transpose(48, 381, rounds / 20 + 1, false) != 0) {
+		rc=1;
+	}
+	fprintf(json, "\n  ],\n  \"jobs\": [\n");
+	/* a PT-P700 with a 24mm tape, whose data is dropped */
+	if ((ptouch_open_capture(&dev, 0x2061, 24, NULL) != 0) || (ptouch_getstatus(dev) != 0) || (jobs_setup(dev) != 0)) {
+		rc=1;
+	} else {
+		for (int k=JOB_SHORT; k<=JOB_CUTMARKS; k++) {
+			if (bench_job(dev, (enum job_kind)k, rounds / 20 + 1, k == JOB_SHORT) != 0) {
+				rc=1;
+			}
+		}
+		ptouch_close(dev);
+	}
+	unlink(png_file);
+	fprintf(json, "\n  ]\n}\n");
+	fclose(json);
+	return rc;
+}
@@ -17,6 +17,8 @@
 	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#define _POSIX_C_SOURCE	200809L	/* needed for getline() when using -std=c11 */
+
 #ifndef USING_CMAKE
 #include "config.h"
 #else
@@ -25,29 +27,39 @@
 
 #include <stdio.h>	/* printf() */
 #include <stdlib.h>	/* exit(), malloc() */
+#include <stdarg.h>	/* va_start() */
 #include <stdbool.h>
 #include <string.h>	/* strcmp(), memcmp() */
+#include <errno.h>
+#include <signal.h>	/* sigaction() */
+#include <time.h>	/* clock_gettime() */
+#include <unistd.h>	/* read(), close(), unlink() */
+#include <poll.h>	/* poll() */
+#include <pthread.h>
 #include <sys/types.h>	/* open() */
 #include <sys/stat.h>	/* open() */
+#include <sys/socket.h>	/* socket(), bind(), accept() */
+#include <sys/un.h>	/* struct sockaddr_un */
 #include <fcntl.h>	/* open() */
 #include <gd.h>
 #include "gettext.h"	/* gettext(), ngettext() */
 #include "ptouch.h"
+#include "text.h"
+#include "render.h"
+#include "stats.h"
+#include "jobcache.h"
+#include "template.h"
 
 #define _(s) gettext(s)
 
-#define MAX_LINES 4	/* maybe this should depend on tape size */
-
-gdImage *image_load(const char *file);
-void rasterline_setpixel(uint8_t* rasterline, size_t size, int pixel);
-int get_baselineoffset(char *text, char *font, int fsz);
-int find_fontsize(int want_px, char *font, char *text);
-int needed_width(char *text, char *font, int fsz);
-int print_img(ptouch_dev ptdev, gdImage *im);
-int write_png(gdImage *im, const char *file);
-gdImage *img_append(gdImage *in_1, gdImage *in_2);
-gdImage *img_cutmark(int tape_width);
-gdImage *render_text(char *font, char *line[], int lines, int tape_width);
+#define DAEMON_MAX_CLIENTS	64
+#define DAEMON_MAX_QUEUE	1024
+#define DAEMON_LINE_MAX		4096
+#define MAX_PRINTERS		16
+#define CAPTURE_PID		0x2061	/* --capture and --replay act as a PT-P700 */
+#define CAPTURE_TAPE_MM		24
+
+pt_bitmap render_segment(void *ctx);
 void unsupported_printer(ptouch_dev ptdev);
 void usage(char *progname);
 int parse_args(int argc, char **argv);
@@ -55,314 +67,112 @@ int parse_args(int argc, char **argv);
 // char *font_file="/usr/share/fonts/TTF/Ubuntu-M.ttf";
 // char *font_file="Ubuntu:medium";
 char *font_file="DejaVuSans";
+int fontsize=0;
 char *save_png=NULL;
+char *font_cache=NULL;
+char *batch_file=NULL;
+char *daemon_socket=NULL;
+char *capture_file=NULL;
+char *replay_file=NULL;
+char *stats_json=NULL;
+char *job_cache=NULL;
+char *template_file=NULL;
+char *csv_file=NULL;
+int job_cache_size=JOBCACHE_SIZE;
 int verbose=0;
-int fontsize=0;
 bool debug=false;
+bool show_info=false;
+bool show_stats=false;
+bool all_printers=false;
+bool hotplug=false;
+struct _pt_selector printer_sel;
+bool have_sel=false;
+pt_render_pool render_pool=NULL;
 
-/* --------------------------------------------------------------------
-   -------------------------------------------------------------------- */
+/* one print command, rendered only when the label is printed */
+struct segment {
+	enum { SEG_TEXT, SEG_IMAGE, SEG_CUTMARK, SEG_PAD, SEG_BARCODE } type;
+	char *font;
+	int fontsize;
+	char *line[MAX_LINES];
+	int lines;
+	char *file;
+	int length;
+	int code;		/* PT_BARCODE_... */
+	int ecc;		/* PT_QR_... */
+	char *data;		/* of the barcode */
+	int dpi;
+	int tape_width;
+};
 
-void rasterline_setpixel(uint8_t* rasterline, size_t size, int pixel)
-{
-	if (pixel > 384) {
-		return;
-	}
+const char *seg_kind[]={ "text", "image", "cutmark", "pad", "barcode" };
 
-	rasterline[(size - 1)-(pixel/8)] |= (uint8_t)(1<<(pixel%8));
-	return;
-}
+int add_segment(pt_label label, struct segment *seg, int height);
+int split_line(char *line, char ***words);
+int build_label(pt_label label, int argc, char **argv, int tape_width, int dpi, bool batch);
+void free_label(pt_label label);
+uint64_t label_key(ptouch_dev ptdev, pt_label label);
+int print_label(ptouch_dev ptdev, pt_label label);
+int eject_label(ptouch_dev ptdev);
+int job_min_width(char **words, int n);
+int start_printers(void);
+void stop_printers(void);
+int open_printers(void);
+void report_stats(void);
+void close_printers(void);
+int run_batch(const char *file);
+int run_template(const char *file, const char *csv);
+int run_daemon(const char *path);
 
-int print_img(ptouch_dev ptdev, gdImage *im)
+pt_bitmap render_segment(void *ctx)
 {
-	int d,i,k,offset,tape_width;
-	uint8_t rasterline[ptdev->devinfo->bytes_per_line];
+	struct segment *seg=ctx;
+	pt_bitmap im=NULL;
+	double t=stats_now();
 
-	if (!im) {
-		printf(_("nothing to print\n"));
-		return -1;
-	}
-	tape_width=ptouch_get_tape_pixel_width(ptdev);
-	/* find out whether color 0 or color 1 is darker */
-	d=(gdImageRed(im,1)+gdImageGreen(im,1)+gdImageBlue(im,1) < gdImageRed(im,0)+gdImageGreen(im,0)+gdImageBlue(im,0))?1:0;
-	if (gdImageSY(im) > tape_width) {
-		printf(_("image is too large (%ipx x %ipx)\n"), gdImageSX(im), gdImageSY(im));
-		printf(_("maximum printing width for this tape is %ipx\n"), tape_width);
-		return -1;
-	}
-	size_t max_pixels=ptouch_get_max_pixel_width(ptdev);
-	offset=((int)max_pixels / 2)-(gdImageSY(im)/2);	/* always print centered  */
-	if ((ptdev->devinfo->flags & FLAG_RASTER_PACKBITS) == FLAG_RASTER_PACKBITS) {
-		if (debug) {
-			printf("enable PackBits mode\n");
+	switch (seg->type) {
+	case SEG_TEXT:
+		if ((im=render_text(seg->font, seg->fontsize, seg->line, seg->lines, seg->tape_width)) == NULL) {
+			printf(_("could not render text\n"));
 		}
-	        ptouch_enable_packbits(ptdev);
-	}
-	if (ptouch_rasterstart(ptdev) != 0) {
-		printf(_("ptouch_rasterstart() failed\n"));
-		return -1;
-	}
-	ptouch_page_flags(ptdev, AUTO_CUT | FEED_SMALL);
-	for (k=0; k<gdImageSX(im); k+=1) {
-		memset(rasterline, 0, sizeof(rasterline));
-		for (i=0; i<gdImageSY(im); i+=1) {
-			if (gdImageGetPixel(im, k, gdImageSY(im)-1-i) == d) {
-				rasterline_setpixel(rasterline, sizeof(rasterline), offset+i);
-			}
+		break;
+	case SEG_IMAGE:
+		if ((im=image_load(seg->file)) == NULL) {
+			printf(_("failed to load image file\n"));
 		}
-		if (ptouch_sendraster(ptdev, rasterline, sizeof(rasterline)) != 0) {
-			printf(_("ptouch_sendraster() failed\n"));
-			return -1;
+		break;
+	case SEG_CUTMARK:
+		im=img_cutmark(seg->tape_width);
+		break;
+	case SEG_PAD:
+		im=img_padding(seg->tape_width, seg->length);
+		break;
+	case SEG_BARCODE:
+		if ((im=ptouch_barcode(seg->code, seg->data, seg->ecc, seg->dpi, seg->tape_width)) == NULL) {
+			printf(_("could not render barcode\n"));
 		}
+		break;
 	}
-	return 0;
-}
-
-/* --------------------------------------------------------------------
-	Function	image_load()
-	Description	detect the type of a image and try to load it
-	Last update	2005-10-16
-	Status		Working, should add debug info
-   -------------------------------------------------------------------- */
-
-gdImage *image_load(const char *file)
-{
-	const uint8_t png[8]={0x89,'P','N','G',0x0d,0x0a,0x1a,0x0a};
-	char d[10];
-	FILE *f;
-	gdImage *img=NULL;
-
-	if ((f = fopen(file, "rb")) == NULL) {	/* error cant open file */
-		return NULL;
-	}
-	if (fread(d, sizeof(d), 1, f) != 1) {
-		return NULL;
-	}
-	rewind(f);
-	if (memcmp(d, png, 8) == 0) {
-		img=gdImageCreateFromPng(f);
-	}
-	fclose(f);
-	return img;
-}
-
-int write_png(gdImage *im, const char *file)
-{
-	FILE *f;
-
-	if ((f = fopen(file, "wb")) == NULL) {
-		printf(_("writing image '%s' failed\n"), file);
-		return -1;
+	if (im != NULL) {
+		stats_segment(seg_kind[seg->type], im->width, t);
 	}
-	gdImagePng(im, f);
-	fclose(f);
-	return 0;
-}
-
-/* --------------------------------------------------------------------
-	Find out the difference in pixels between a "normal" char and one
-	that goes below the font baseline
-   -------------------------------------------------------------------- */
-int get_baselineoffset(char *text, char *font, int fsz)
-{
-	int brect[8];
-
-	if (strpbrk(text, "QgjpqyQµ") == NULL) {	/* if we have none of these */
-		return 0;		/* we don't need an baseline offset */
-	}				/* else we need to calculate it */
-	gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, "o");
-	int tmp=brect[1]-brect[5];
-	gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, "g");
-	return (brect[1]-brect[5])-tmp;
+	return im;
 }
 
-/* --------------------------------------------------------------------
-	Find out which fontsize we need for a given font to get a
-	specified pixel size
-	NOTE: This does NOT work for some UTF-8 chars like µ
-   -------------------------------------------------------------------- */
-int find_fontsize(int want_px, char *font, char *text)
+/* queue a copy of seg on the label, to be rendered when it is printed */
+int add_segment(pt_label label, struct segment *seg, int height)
 {
-	int save=0;
-	int brect[8];
+	struct segment *copy;
 
-	for (int i=4; ; i++) {
-		if (gdImageStringFT(NULL, &brect[0], -1, font, i, 0.0, 0, 0, text) != NULL) {
-			break;
-		}
-		if (brect[1]-brect[5] <= want_px) {
-			save=i;
-		} else {
-			break;
-		}
-	}
-	if (save == 0) {
+	if ((copy=malloc(sizeof(*copy))) == NULL) {
 		return -1;
 	}
-	return save;
-}
-
-int needed_width(char *text, char *font, int fsz)
-{
-	int brect[8];
-
-	if (gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, text) != NULL) {
+	*copy=*seg;
+	if (ptouch_label_append_lazy(label, height, render_segment, copy) != 0) {
+		free(copy);
 		return -1;
 	}
-	return brect[2]-brect[0];
-}
-
-gdImage *render_text(char *font, char *line[], int lines, int tape_width)
-{
-	int brect[8];
-	int i, black, x=0, tmp=0, fsz=0;
-	char *p;
-	gdImage *im=NULL;
-
-	if (debug) {
-		printf(_("render_text(): %i lines, font = '%s'\n"), lines, font);
-	}
-	if (gdFTUseFontConfig(1) != GD_TRUE) {
-		printf(_("warning: font config not available\n"));
-	}
-	if (fontsize > 0) {
-		fsz=fontsize;
-		printf(_("setting font size=%i\n"), fsz);
-	} else {
-		for (i=0; i<lines; i++) {
-			if ((tmp=find_fontsize(tape_width/lines, font, line[i])) < 0) {
-				printf(_("could not estimate needed font size\n"));
-				return NULL;
-			}
-			if ((fsz == 0) || (tmp < fsz)) {
-				fsz=tmp;
-			}
-		}
-		printf(_("choosing font size=%i\n"), fsz);
-	}
-	for(i=0; i<lines; i++) {
-		tmp=needed_width(line[i], font_file, fsz);
-		if (tmp > x) {
-			x=tmp;
-		}
-	}
-	/* extra space at the end of the label in pixels - 32 to accommodate the text on tapes, and 32 for actual
-	 * padding */
-	int padding = 64;
-	im=gdImageCreatePalette(x + padding, tape_width);
-	gdImageColorAllocate(im, 255, 255, 255);
-	black=gdImageColorAllocate(im, 0, 0, 0);
-	/* gdImageStringFT(im,brect,fg,fontlist,size,angle,x,y,string) */
-	/* find max needed line height for ALL lines */
-	int max_height=0;
-	for (i=0; i<lines; i++) {
-		if ((p=gdImageStringFT(NULL, &brect[0], -black, font, fsz, 0.0, 0, 0, line[i])) != NULL) {
-			printf(_("error in gdImageStringFT: %s\n"), p);
-		}
-		//int ofs=get_baselineoffset(line[i], font_file, fsz);
-		int lineheight=brect[1]-brect[5];
-		if (lineheight > max_height) {
-			max_height=lineheight;
-		}
-	}
-	if (debug) {
-		printf("debug: needed (max) height is %ipx\n", max_height);
-	}
-	/* now render lines */
-	for (i=0; i<lines; i++) {
-		int ofs=get_baselineoffset(line[i], font_file, fsz);
-		int pos=((i)*(tape_width/(lines)))+(max_height)-ofs-1;
-		if (debug) {
-			printf("debug: line %i pos=%i ofs=%i\n", i+1, pos, ofs);
-		}
-		if ((p=gdImageStringFT(im, &brect[0], -black, font, fsz, 0.0, 0, pos, line[i])) != NULL) {
-			printf(_("error in gdImageStringFT: %s\n"), p);
-		}
-	}
-	return im;
-}
-
-gdImage *img_append(gdImage *in_1, gdImage *in_2)
-{
-	gdImage *out=NULL;
-	int width=0;
-	int i_1_x=0;
-	int length=0;
-
-	if (in_1 != NULL) {
-		width=gdImageSY(in_1);
-		length=gdImageSX(in_1);
-		i_1_x=gdImageSX(in_1);
-	}
-	if (in_2 != NULL) {
-		length += gdImageSX(in_2);
-		/* width should be the same, but let's be sure */
-		if (gdImageSY(in_2) > width) {
-			width=gdImageSY(in_2);
-		}
-	}
-	if ((width == 0) || (length == 0)) {
-		return NULL;
-	}
-	out=gdImageCreatePalette(length, width);
-	if (out == NULL) {
-		return NULL;
-	}
-	gdImageColorAllocate(out, 255, 255, 255);
-	gdImageColorAllocate(out, 0, 0, 0);
-	if (debug) {
-		printf("debug: created new img with size %d * %d\n", length, width);
-	}
-	if (in_1 != NULL) {
-		gdImageCopy(out, in_1, 0, 0, 0, 0, gdImageSX(in_1), gdImageSY(in_1));
-		if (debug) {
-			printf("debug: copied part 1\n");
-		}
-	}
-	if (in_2 != NULL) {
-		gdImageCopy(out, in_2, i_1_x, 0, 0, 0, gdImageSX(in_2), gdImageSY(in_2));
-		if (debug) {
-			printf("copied part 2\n");
-		}
-	}
-	return out;
-}
-
-gdImage *img_cutmark(int tape_width)
-{
-	gdImage *out=NULL;
-	int style_dashed[6];
-
-	out=gdImageCreatePalette(9, tape_width);
-	if (out == NULL) {
-		return NULL;
-	}
-	gdImageColorAllocate(out, 255, 255, 255);
-	int black=gdImageColorAllocate(out, 0, 0, 0);
-	style_dashed[0]=gdTransparent;
-	style_dashed[1]=gdTransparent;
-	style_dashed[2]=gdTransparent;
-	style_dashed[3]=black;
-	style_dashed[4]=black;
-	style_dashed[5]=black;
-	gdImageSetStyle(out, style_dashed, 6);
-	gdImageLine(out, 5, 0, 5, tape_width-1, gdStyled);
-	return out;
-}
-
-gdImage *img_padding(int tape_width, int length)
-{
-	gdImage *out=NULL;
-
-	if ((length < 1) || (length > 256)) {
-		length=1;
-	}
-	out=gdImageCreatePalette(length, tape_width);
-	if (out == NULL) {
-		return NULL;
-	}
-	gdImageColorAllocate(out, 255, 255, 255);
-	return out;
+	return 0;
 }
 
 void usage(char *progname)
@@ -372,6 +182,30 @@ void usage(char *progname)
 	printf("\t--font <file>\t\tuse font <file> or <name>\n");
 	printf("\t--writepng <file>\tinstead of printing, write output to png file\n");
 	printf("\t\t\t\tThis currently works only when using\n\t\t\t\tEXACTLY ONE --text statement\n");
+	printf("\t--fontcache <file>\tkeep font metrics in <file> between runs\n");
+	printf("\t--batch <file>\t\tprint one label per line of <file> (- for stdin),\n");
+	printf("\t\t\t\teach line holding print-commands as below\n");
+	printf("\t--daemon <socket>\tkeep the printer open and print the labels\n");
+	printf("\t\t\t\tsent to the unix socket <socket>, one per line\n");
+	printf("\t--template <file>\tprint one label per record of the --csv file,\n");
+	printf("\t\t\t\t<file> holding print-commands as below whose\n");
+	printf("\t\t\t\ttext and barcode data have {column} slots\n");
+	printf("\t--csv <file>\t\tthe records for --template (- for stdin), the\n");
+	printf("\t\t\t\tfirst line naming the columns\n");
+	printf("\t--all-printers\t\twith --batch or --daemon, share the labels out\n");
+	printf("\t\t\t\tbetween all attached printers\n");
+	printf("\t--hotplug\t\twith --daemon, use printers as they are plugged in\n");
+	printf("\t--printer <where>\tuse the printer at <bus>:<address>, at the port\n");
+	printf("\t\t\t\tpath <bus>-<port>[.<port>...] or serial=<serial>\n");
+	printf("\t--capture <file>\tinstead of printing, write what would be sent\n");
+	printf("\t\t\t\tto the printer to <file>\n");
+	printf("\t--replay <file>\t\twithout a printer, take its status replies\n");
+	printf("\t\t\t\tfrom <file>\n");
+	printf("\t--cache <dir>\t\tkeep the printer data of labels in <dir> and\n");
+	printf("\t\t\t\tsend it from there when they are printed again\n");
+	printf("\t--cache-size <n>\tlimit the cache to n MiB (default %i)\n", JOBCACHE_SIZE);
+	printf("\t--stats\t\t\tshow how long each step took\n");
+	printf("\t--stats-json <file>\twrite the same as JSON to <file>\n");
 	printf("print-commands:\n");
 	printf("\t--image <file>\t\tprint the given image which must be a 2 color\n");
 	printf("\t\t\t\t(black/white) png\n");
@@ -380,13 +214,17 @@ void usage(char *progname)
 	printf("\t--cutmark\t\tPrint a mark where the tape should be cut\n");
 	printf("\t--fontsize\t\tManually set fontsize\n");
 	printf("\t--pad <n>\t\tAdd n pixels padding (blank tape)\n");
+	printf("\t--barcode <type> <data>\tPrint a barcode, <type> being code128, ean13\n");
+	printf("\t\t\t\tor qr\n");
+	printf("\t--qr-ecc <level>\tError correction of QR codes: L, M (default),\n");
+	printf("\t\t\t\tQ or H\n");
 	exit(1);
 }
 
 /* here we don't print anything, but just try to catch syntax errors */
 int parse_args(int argc, char **argv)
 {
-	int lines, i;
+	int lines, i, commands=0;
 
 	for (i=1; i<argc; i++) {
 		if (*argv[i] != '-') {
@@ -400,7 +238,7 @@ int parse_args(int argc, char **argv)
 			}
 		} else if (strcmp(&argv[i][1], "-fontsize") == 0) {
 			if (i+1<argc) {
-				i++;
+				fontsize=strtol(argv[++i], NULL, 10);
 			} else {
 				usage(argv[0]);
 			}
@@ -410,25 +248,117 @@ int parse_args(int argc, char **argv)
 			} else {
 				usage(argv[0]);
 			}
+		} else if (strcmp(&argv[i][1], "-fontcache") == 0) {
+			if (i+1<argc) {
+				font_cache=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-batch") == 0) {
+			if (i+1<argc) {
+				batch_file=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-daemon") == 0) {
+			if (i+1<argc) {
+				daemon_socket=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-template") == 0) {
+			if (i+1<argc) {
+				template_file=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-csv") == 0) {
+			if (i+1<argc) {
+				csv_file=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-all-printers") == 0) {
+			all_printers=true;
+		} else if (strcmp(&argv[i][1], "-hotplug") == 0) {
+			hotplug=true;
+		} else if (strcmp(&argv[i][1], "-printer") == 0) {
+			if (i+1<argc) {
+				if (ptouch_parse_selector(argv[++i], &printer_sel) != 0) {
+					printf(_("invalid printer '%s'\n"), argv[i]);
+					usage(argv[0]);
+				}
+				have_sel=true;
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-capture") == 0) {
+			if (i+1<argc) {
+				capture_file=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-replay") == 0) {
+			if (i+1<argc) {
+				replay_file=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-cache") == 0) {
+			if (i+1<argc) {
+				job_cache=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-cache-size") == 0) {
+			if (i+1<argc) {
+				job_cache_size=strtol(argv[++i], NULL, 10);
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-stats") == 0) {
+			show_stats=true;
+		} else if (strcmp(&argv[i][1], "-stats-json") == 0) {
+			if (i+1<argc) {
+				stats_json=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
 		} else if (strcmp(&argv[i][1], "-cutmark") == 0) {
-			continue;	/* not done here */
+			commands++;
 		} else if (strcmp(&argv[i][1], "-debug") == 0) {
 			debug=true;
 		} else if (strcmp(&argv[i][1], "-info") == 0) {
-			continue;	/* not done here */
+			show_info=true;
 		} else if (strcmp(&argv[i][1], "-image") == 0) {
 			if (i+1<argc) {
 				i++;
+				commands++;
 			} else {
 				usage(argv[0]);
 			}
 		} else if (strcmp(&argv[i][1], "-pad") == 0) {
+			if (i+1<argc) {
+				i++;
+				commands++;
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-barcode") == 0) {
+			if (i+2<argc) {
+				i+=2;
+				commands++;
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-qr-ecc") == 0) {
 			if (i+1<argc) {
 				i++;
 			} else {
 				usage(argv[0]);
 			}
 		} else if (strcmp(&argv[i][1], "-text") == 0) {
+			commands++;
 			for (lines=0; (lines < MAX_LINES) && (i < argc); lines++) {
 				if ((i+1 >= argc) || (argv[i+1][0] == '-')) {
 					break;
@@ -442,124 +372,1611 @@ int parse_args(int argc, char **argv)
 			usage(argv[0]);
 		}
 	}
-	return i;
-}
-
-int main(int argc, char *argv[])
-{
-	int i, lines = 0, tape_width;
-	char *line[MAX_LINES];
-	gdImage *im=NULL;
-	gdImage *out=NULL;
-	ptouch_dev ptdev=NULL;
-
-	setlocale(LC_ALL, "");
-	bindtextdomain(PACKAGE, LOCALEDIR);
-	textdomain(PACKAGE);
-	i=parse_args(argc, argv);
-	if (i != argc) {
+	/* in batch and daemon mode the labels come from the file or socket only */
+	if (((batch_file != NULL) || (daemon_socket != NULL)) && (commands > 0)) {
 		usage(argv[0]);
 	}
-	if ((ptouch_open(&ptdev)) < 0) {
-		return 5;
+	if ((batch_file != NULL) && (daemon_socket != NULL)) {
+		usage(argv[0]);
 	}
-	if (ptouch_init(ptdev) != 0) {
-		printf(_("ptouch_init() failed\n"));
+	/* a template takes the place of the print-commands */
+	if ((template_file == NULL) != (csv_file == NULL)) {
+		usage(argv[0]);
 	}
-	if (ptouch_getstatus(ptdev) != 0) {
-		printf(_("ptouch_getstatus() failed\n"));
-		return 1;
+	if ((template_file != NULL) && ((commands > 0) || (batch_file != NULL) || (daemon_socket != NULL) || all_printers)) {
+		usage(argv[0]);
 	}
-	tape_width=ptouch_get_tape_pixel_width(ptdev);
-	for (i=1; i<argc; i++) {
-		if (*argv[i] != '-') {
+	/* a single label goes to a single printer */
+	if (all_printers && (batch_file == NULL) && (daemon_socket == NULL) && !show_info) {
+		usage(argv[0]);
+	}
+	if ((hotplug && (daemon_socket == NULL)) || (have_sel && (all_printers || hotplug))) {
+		usage(argv[0]);
+	}
+	/* there is only the one printer that is not there */
+	if (((capture_file != NULL) || (replay_file != NULL)) && (all_printers || hotplug || have_sel)) {
+		usage(argv[0]);
+	}
+	return i;
+}
+
+/* --------------------------------------------------------------------
+	Split a line into words the way a shell would: words are
+	separated by blanks, '...' and "..." quote, a backslash escapes
+	the next character and # starts a comment. Works in place.
+	Returns the number of words, or -1 on unbalanced quotes.
+   -------------------------------------------------------------------- */
+int split_line(char *line, char ***words)
+{
+	char *in=line, *out=line, **w=NULL, **tmp;
+	int n=0, allocated=0;
+
+	for (;;) {
+		while ((*in == ' ') || (*in == '\t') || (*in == '\r') || (*in == '\n')) {
+			in++;
+		}
+		if ((*in == '\0') || (*in == '#')) {
 			break;
 		}
-		if (strcmp(&argv[i][1], "-font") == 0) {
-			if (i+1<argc) {
-				font_file=argv[++i];
-			} else {
-				usage(argv[0]);
+		if (n + 1 >= allocated) {
+			allocated=(allocated > 0) ? allocated * 2 : 16;
+			if ((tmp=realloc(w, (size_t)allocated * sizeof(*w))) == NULL) {
+				free(w);
+				return -1;
 			}
-		} else if (strcmp(&argv[i][1], "-fontsize") == 0) {
-			if (i+1<argc) {
-				fontsize=strtol(argv[++i], NULL, 10);
+			w=tmp;
+		}
+		w[n++]=out;
+		while ((*in != '\0') && (*in != ' ') && (*in != '\t') && (*in != '\r') && (*in != '\n')) {
+			if ((*in == '\'') || (*in == '"')) {
+				char q=*in++;
+				while ((*in != '\0') && (*in != q)) {
+					if ((q == '"') && (*in == '\\') && ((in[1] == '"') || (in[1] == '\\'))) {
+						in++;
+					}
+					*out++=*in++;
+				}
+				if (*in == '\0') {
+					free(w);
+					return -1;
+				}
+				in++;
+			} else if ((*in == '\\') && (in[1] != '\0')) {
+				in++;
+				*out++=*in++;
 			} else {
-				usage(argv[0]);
+				*out++=*in++;
 			}
-		} else if (strcmp(&argv[i][1], "-writepng") == 0) {
-			if (i+1<argc) {
-				save_png=argv[++i];
-			} else {
-				usage(argv[0]);
+		}
+		if (*in != '\0') {
+			in++;
+		}
+		*out++='\0';
+	}
+	if (w != NULL) {
+		w[n]=NULL;
+	}
+	*words=w;
+	return n;
+}
+
+/* --------------------------------------------------------------------
+	Add the print commands in argv to label. Options that only make
+	sense once per run are refused in batch files.
+   -------------------------------------------------------------------- */
+int build_label(pt_label label, int argc, char **argv, int tape_width, int dpi, bool batch)
+{
+	static const char *codes[]={ "code128", "ean13", "qr" };
+	char *font=font_file;
+	/* like --font, --fontsize on the command line is the default of
+	   batch lines, on the command line itself it applies in order */
+	int i, lines, fsz=batch ? fontsize : 0, ecc=PT_QR_M;
+
+	ptouch_label_set_pool(label, render_pool);
+	for (i=0; i<argc; i++) {
+		if (*argv[i] != '-') {
+			printf(_("unexpected argument '%s'\n"), argv[i]);
+			return -1;
+		}
+		if ((strcmp(&argv[i][1], "-font") == 0) || (strcmp(&argv[i][1], "-fontsize") == 0)
+			|| (strcmp(&argv[i][1], "-image") == 0) || (strcmp(&argv[i][1], "-pad") == 0)
+			|| (strcmp(&argv[i][1], "-qr-ecc") == 0)) {
+			if (i+1 >= argc) {
+				printf(_("'%s' needs an argument\n"), argv[i]);
+				return -1;
 			}
-		} else if (strcmp(&argv[i][1], "-info") == 0) {
-			printf(_("maximum printing width for this tape is %ipx\n"), tape_width);
-			printf("media type = %02x\n", ptdev->status->media_type);
-			printf("media width = %d mm\n", ptdev->status->media_width);
-			printf("tape color = %02x\n", ptdev->status->tape_color);
-			printf("text color = %02x\n", ptdev->status->text_color);
-			printf("error = %04x\n", ptdev->status->error);
-			exit(0);
+		}
+		if ((strcmp(&argv[i][1], "-barcode") == 0) && (i+2 >= argc)) {
+			printf(_("'%s' needs a type and the data\n"), argv[i]);
+			return -1;
+		}
+		if (strcmp(&argv[i][1], "-font") == 0) {
+			font=argv[++i];
+		} else if (strcmp(&argv[i][1], "-fontsize") == 0) {
+			fsz=strtol(argv[++i], NULL, 10);
 		} else if (strcmp(&argv[i][1], "-image") == 0) {
-			im=image_load(argv[++i]);
-			if (im == NULL) {
+			struct segment seg={ .type=SEG_IMAGE, .file=argv[++i], .tape_width=tape_width };
+			int height=image_height(seg.file);
+			if (height < 0) {
 				printf(_("failed to load image file\n"));
-				return 1;
+				return -1;
+			}
+			if (add_segment(label, &seg, height) != 0) {
+				printf(_("out of memory\n"));
+				return -1;
 			}
-			out=img_append(out, im);
-			gdImageDestroy(im);
-			im = NULL;
 		} else if (strcmp(&argv[i][1], "-text") == 0) {
+			struct segment seg={ .type=SEG_TEXT, .font=font, .fontsize=fsz, .tape_width=tape_width };
 			for (lines=0; (lines < MAX_LINES) && (i < argc); lines++) {
 				if ((i+1 >= argc) || (argv[i+1][0] == '-')) {
 					break;
 				}
 				i++;
-				line[lines]=argv[i];
+				seg.line[lines]=argv[i];
 			}
+			seg.lines=lines;
 			if (lines) {
-				if ((im=render_text(font_file, line, lines, tape_width)) == NULL) {
-					printf(_("could not render text\n"));
-					return 1;
+				if (add_segment(label, &seg, tape_width) != 0) {
+					printf(_("out of memory\n"));
+					return -1;
 				}
-				out=img_append(out, im);
-				gdImageDestroy(im);
-				im = NULL;
 			}
-		} else if (strcmp(&argv[i][1], "-cutmark") == 0) {
-			im=img_cutmark(tape_width);
-			out=img_append(out, im);
-			gdImageDestroy(im);
-			im = NULL;
+		} else if (strcmp(&argv[i][1], "-qr-ecc") == 0) {
+			const char *levels="LMQH", *l=strchr(levels, argv[++i][0]);
+			if ((l == NULL) || (argv[i][0] == '\0') || (argv[i][1] != '\0')) {
+				printf(_("unknown error correction level '%s'\n"), argv[i]);
+				return -1;
+			}
+			ecc=(int)(l - levels);
+		} else if (strcmp(&argv[i][1], "-barcode") == 0) {
+			struct segment seg={ .type=SEG_BARCODE, .ecc=ecc, .dpi=dpi, .tape_width=tape_width };
+			for (seg.code=0; seg.code<3; seg.code++) {
+				if (strcmp(argv[i+1], codes[seg.code]) == 0) {
+					break;
+				}
+			}
+			if (seg.code == 3) {
+				printf(_("unknown barcode type '%s'\n"), argv[i+1]);
+				return -1;
+			}
+			seg.data=argv[i+2];
+			i+=2;
+			if (add_segment(label, &seg, tape_width) != 0) {
+				printf(_("out of memory\n"));
+				return -1;
+			}
+		} else if (strcmp(&argv[i][1], "-cutmark") == 0) {
+			struct segment seg={ .type=SEG_CUTMARK, .tape_width=tape_width };
+			if (add_segment(label, &seg, tape_width) != 0) {
+				printf(_("out of memory\n"));
+				return -1;
+			}
 		} else if (strcmp(&argv[i][1], "-pad") == 0) {
-			int length=strtol(argv[++i], NULL, 10);
-			im=img_padding(tape_width, length);
-			out=img_append(out, im);
-			gdImageDestroy(im);
-			im = NULL;
-		} else if (strcmp(&argv[i][1], "-debug") == 0) {
-			debug = true;
+			struct segment seg={ .type=SEG_PAD, .tape_width=tape_width };
+			seg.length=strtol(argv[++i], NULL, 10);
+			if (add_segment(label, &seg, tape_width) != 0) {
+				printf(_("out of memory\n"));
+				return -1;
+			}
+		} else if (!batch && ((strcmp(&argv[i][1], "-writepng") == 0) || (strcmp(&argv[i][1], "-fontcache") == 0)
+			|| (strcmp(&argv[i][1], "-printer") == 0) || (strcmp(&argv[i][1], "-capture") == 0)
+			|| (strcmp(&argv[i][1], "-replay") == 0) || (strcmp(&argv[i][1], "-stats-json") == 0)
+			|| (strcmp(&argv[i][1], "-cache") == 0) || (strcmp(&argv[i][1], "-cache-size") == 0))) {
+			i++;	/* already done in parse_args() */
+		} else if (!batch && ((strcmp(&argv[i][1], "-debug") == 0) || (strcmp(&argv[i][1], "-info") == 0)
+			|| (strcmp(&argv[i][1], "-all-printers") == 0) || (strcmp(&argv[i][1], "-stats") == 0))) {
+			continue;
 		} else {
-			usage(argv[0]);
+			printf(_("'%s' can not be used here\n"), argv[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void free_label(pt_label label)
+{
+	for (int i=0; i<label->nseg; i++) {
+		free(label->seg[i].ctx);
+	}
+	ptouch_label_free(label);
+}
+
+/* --------------------------------------------------------------------
+	The key of a label in the --cache: a hash of everything the data
+	sent to the printer depends on, the contents of images and the
+	font files text is drawn with included.
+	Returns 0 for a label that can not be cached.
+   -------------------------------------------------------------------- */
+uint64_t label_key(ptouch_dev ptdev, pt_label label)
+{
+	uint64_t h=JOBCACHE_SEED;
+	const char *path;
+	int64_t mtime;
+	int dev[4]={ ptdev->devinfo->pid, ptdev->devinfo->flags, (int)ptdev->devinfo->bytes_per_line,
+		ptouch_get_tape_pixel_width(ptdev) };
+
+	h=jobcache_hash(h, VERSION, strlen(VERSION));
+	h=jobcache_hash(h, dev, sizeof(dev));
+	for (int i=0; i<label->nseg; i++) {
+		struct segment *seg=label->seg[i].ctx;
+		if (seg == NULL) {
+			return 0;
+		}
+		h=jobcache_hash(h, &seg->type, sizeof(seg->type));
+		h=jobcache_hash(h, &seg->tape_width, sizeof(seg->tape_width));
+		switch (seg->type) {
+		case SEG_TEXT:
+			/* the name may resolve to another file once fonts change */
+			if (text_font_file(seg->font, &path, &mtime) != 0) {
+				return 0;
+			}
+			h=jobcache_hash(h, path, strlen(path) + 1);
+			h=jobcache_hash(h, &mtime, sizeof(mtime));
+			h=jobcache_hash(h, &seg->fontsize, sizeof(seg->fontsize));
+			h=jobcache_hash(h, &seg->lines, sizeof(seg->lines));
+			for (int k=0; k<seg->lines; k++) {
+				h=jobcache_hash(h, seg->line[k], strlen(seg->line[k]) + 1);
+			}
+			break;
+		case SEG_IMAGE:
+			if ((h=jobcache_hash_file(h, seg->file)) == 0) {
+				return 0;
+			}
+			break;
+		case SEG_CUTMARK:
+			break;
+		case SEG_PAD:
+			h=jobcache_hash(h, &seg->length, sizeof(seg->length));
+			break;
+		case SEG_BARCODE:
+			h=jobcache_hash(h, &seg->code, sizeof(seg->code));
+			h=jobcache_hash(h, &seg->ecc, sizeof(seg->ecc));
+			h=jobcache_hash(h, &seg->dpi, sizeof(seg->dpi));
+			h=jobcache_hash(h, seg->data, strlen(seg->data) + 1);
+			break;
+		}
+	}
+	return (h != 0) ? h : 1;
+}
+
+/* print the label, or write it to the png file if one was given */
+int print_label(ptouch_dev ptdev, pt_label label)
+{
+	pt_bitmap im;
+	const uint8_t *data;
+	uint8_t *rec;
+	uint64_t key=0;
+	size_t len;
+	int r;
+
+	if (save_png) {
+		if ((im=ptouch_label_render(label)) == NULL) {
+			printf(_("could not render label\n"));
+			return -1;
+		}
+		write_png(im, save_png);
+		ptouch_bitmap_free(im);
+		return 0;
+	}
+	if (job_cache != NULL) {
+		key=label_key(ptdev, label);
+	}
+	if ((key != 0) && (jobcache_get(key, &data, &len) == 0)) {
+		r=print_stream(ptdev, data, len);
+		jobcache_release(data, len);
+	} else {
+		if (key != 0) {
+			ptouch_record_start(ptdev);
+		}
+		r=print_img(ptdev, label);
+		if ((key != 0) && ((rec=ptouch_record_stop(ptdev, &len)) != NULL)) {
+			if (r == 0) {
+				jobcache_put(key, rec, len);
+			}
+			free(rec);
+		}
+	}
+	if (r != 0) {
+		return -1;
+	}
+	return eject_label(ptdev);
+}
+
+int eject_label(ptouch_dev ptdev)
+{
+	double t=stats_now();
+	int r;
+
+	r=ptouch_eject(ptdev);
+	stats_add(STATS_SEND, t);
+	if (r != 0) {
+		if (ptouch_monitor_error(ptdev) != 0) {
+			printf(_("printer reported error %04x\n"), ptouch_monitor_error(ptdev) & 0xffff);
+		}
+		printf(_("ptouch_eject() failed\n"));
+		return -1;
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Printers and the job queue that batch and daemon mode share. Every
+	printer has a thread of its own that takes the oldest queued job
+	its tape is wide enough for, so with --all-printers several labels
+	go out at the same time.
+   -------------------------------------------------------------------- */
+
+struct printer {
+	ptouch_dev ptdev;
+	int tape_width;
+	pthread_t thread;
+	bool running;
+	bool failed;		/* stopped taking jobs after an error */
+};
+
+struct client {
+	int fd;
+	int refs;		/* the connection itself plus each of its jobs */
+	size_t len;
+	char buf[DAEMON_LINE_MAX];
+};
+
+struct job {
+	struct job *next;
+	unsigned long id;	/* the line number in batch mode */
+	struct client *client;	/* NULL in batch mode */
+	int min_width;		/* narrowest tape in px the label fits on */
+	struct timespec queued;
+	char line[];
+};
+
+struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* a job was queued, or we stop */
+	pthread_cond_t space;	/* a job left the queue */
+	struct job *head, *tail;
+	int len;
+	int failed;		/* jobs that did not print */
+	bool stop;
+} jobs={ .lock=PTHREAD_MUTEX_INITIALIZER, .cond=PTHREAD_COND_INITIALIZER, .space=PTHREAD_COND_INITIALIZER };
+
+struct printer printers[MAX_PRINTERS];
+int nprinters=0;
+
+double ms_since(struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - since->tv_sec) * 1000 + (double)(now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+/* send a line to the client, jobs.lock must be held */
+void client_reply(struct client *c, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n=vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+		return;
+	}
+	if ((size_t)n >= sizeof(msg)) {
+		n=sizeof(msg) - 1;
+	}
+	/* Called with jobs.lock held, so this must not block: a client that
+	   went away just misses its answer, one that does not read them
+	   is disconnected once its socket buffer is full */
+	if (send(c->fd, msg, (size_t)n, MSG_NOSIGNAL | MSG_DONTWAIT) != n) {
+		shutdown(c->fd, SHUT_RDWR);
+	}
+}
+
+/* drop a reference, jobs.lock must be held */
+void client_release(struct client *c)
+{
+	if (--c->refs == 0) {
+		close(c->fd);
+		free(c);
+	}
+}
+
+/* Text is fitted to whatever tape it ends up on, but images are not
+   scaled, so the highest image decides which printers can take a label */
+int job_min_width(char **words, int n)
+{
+	int h, need=0;
+
+	for (int i=0; i+1<n; i++) {
+		if ((strcmp(words[i], "--image") == 0) && ((h=image_height(words[++i])) > need)) {
+			need=h;
+		}
+	}
+	return need;
+}
+
+/* jobs.lock must be held */
+bool job_fits_any(int min_width)
+{
+	for (int i=0; i<nprinters; i++) {
+		if (!printers[i].failed && (printers[i].tape_width >= min_width)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* report how a job went and free it, jobs.lock must be held */
+void job_done(struct job *j, const char *err, double wait, double busy)
+{
+	if (err != NULL) {
+		jobs.failed++;
+	}
+	if (j->client == NULL) {
+		if (err != NULL) {
+			printf(_("%s:%lu: %s\n"), batch_file, j->id, err);
+		}
+	} else {
+		if (err != NULL) {
+			client_reply(j->client, "done %lu error %s\n", j->id, err);
+		} else {
+			client_reply(j->client, "done %lu ok %.1f %.1f\n", j->id, wait, busy);
+		}
+		client_release(j->client);
+	}
+	free(j);
+}
+
+/* --------------------------------------------------------------------
+	Queue line as job id, jobs.lock must be held. With wait set this
+	blocks while the queue is full, else a full queue is an error.
+	Returns NULL, or why the job was not queued.
+   -------------------------------------------------------------------- */
+const char *job_queue(unsigned long id, struct client *c, const char *line, int min_width, bool wait)
+{
+	struct job *j;
+	size_t len=strlen(line);
+
+	while (wait && (jobs.len >= DAEMON_MAX_QUEUE) && job_fits_any(0)) {
+		pthread_cond_wait(&jobs.space, &jobs.lock);
+	}
+	if (!job_fits_any(0)) {
+		return "no printer left";
+	}
+	if (jobs.len >= DAEMON_MAX_QUEUE) {
+		return "queue full";
+	}
+	if (!job_fits_any(min_width)) {
+		return "no printer with a wide enough tape";
+	}
+	if ((j=malloc(sizeof(*j) + len + 1)) == NULL) {
+		return "out of memory";
+	}
+	j->next=NULL;
+	j->id=id;
+	j->client=c;
+	if (c != NULL) {
+		c->refs++;
+	}
+	j->min_width=min_width;
+	clock_gettime(CLOCK_MONOTONIC, &j->queued);
+	memcpy(j->line, line, len + 1);
+	if (jobs.tail != NULL) {
+		jobs.tail->next=j;
+	} else {
+		jobs.head=j;
+	}
+	jobs.tail=j;
+	jobs.len++;
+	/* not every printer may fit it, so wake them all */
+	pthread_cond_broadcast(&jobs.cond);
+	return NULL;
+}
+
+/* unlink j, whose predecessor is prev, jobs.lock must be held */
+void job_unlink(struct job *j, struct job *prev)
+{
+	if (prev != NULL) {
+		prev->next=j->next;
+	} else {
+		jobs.head=j->next;
+	}
+	if (jobs.tail == j) {
+		jobs.tail=prev;
+	}
+	jobs.len--;
+	pthread_cond_broadcast(&jobs.space);
+}
+
+/* the oldest job for a tape of width px, jobs.lock must be held */
+struct job *job_take(int width)
+{
+	for (struct job *j=jobs.head, *prev=NULL; j != NULL; prev=j, j=j->next) {
+		if (j->min_width <= width) {
+			job_unlink(j, prev);
+			return j;
+		}
+	}
+	return NULL;
+}
+
+/* fail the jobs no printer is left for, jobs.lock must be held */
+void job_purge(void)
+{
+	struct job *j=jobs.head, *prev=NULL, *next;
+
+	for (; j != NULL; j=next) {
+		next=j->next;
+		if (job_fits_any(j->min_width)) {
+			prev=j;
+			continue;
 		}
+		job_unlink(j, prev);
+		job_done(j, "no printer left", 0, 0);
 	}
-	if (out) {
-		if (save_png) {
-			write_png(out, save_png);
+}
+
+void *printer_worker(void *arg)
+{
+	struct printer *p=arg;
+
+	pthread_mutex_lock(&jobs.lock);
+	for (;;) {
+		struct job *j;
+		struct timespec start;
+		char **words=NULL, *err=NULL;
+		pt_label label;
+		ptouch_dev ptdev;
+		double wait, busy;
+		bool broken=false;
+		int n, tape_width;
+
+		if (p->failed) {
+			break;	/* unplugged */
+		}
+		if ((j=job_take(p->tape_width)) == NULL) {
+			if (jobs.stop) {
+				break;
+			}
+			pthread_cond_wait(&jobs.cond, &jobs.lock);
+			continue;
+		}
+		/* the slot is only refilled by attach_printer() after joining us,
+		   but take what the job needs while holding the lock */
+		ptdev=p->ptdev;
+		tape_width=p->tape_width;
+		pthread_mutex_unlock(&jobs.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		wait=ms_since(&j->queued);
+		if ((n=split_line(j->line, &words)) <= 0) {
+			err="syntax error";
+		} else if ((label=ptouch_label_new()) == NULL) {
+			err="out of memory";
 		} else {
-			print_img(ptdev, out);
-			if (ptouch_eject(ptdev) != 0) {
-				printf(_("ptouch_eject() failed\n"));
+			if ((build_label(label, n, words, tape_width, ptdev->devinfo->dpi, true) != 0) || (label->nseg == 0)) {
+				err="invalid label";
+			} else if (print_label(ptdev, label) != 0) {
+				err="printing failed";
+				broken=true;
+			}
+			free_label(label);
+		}
+		free(words);
+		busy=ms_since(&start);
+
+		pthread_mutex_lock(&jobs.lock);
+		job_done(j, err, wait, busy);
+		if (broken) {
+			/* leave the rest to the other printers, if any */
+			printf(_("printer %i failed, no more labels for it\n"), (int)(p - printers) + 1);
+			p->failed=true;
+			job_purge();
+			break;
+		}
+	}
+	pthread_mutex_unlock(&jobs.lock);
+	return NULL;
+}
+
+int printer_start(struct printer *p)
+{
+	if (pthread_create(&p->thread, NULL, printer_worker, p) != 0) {
+		p->failed=true;
+		return -1;
+	}
+	p->running=true;
+	return 0;
+}
+
+/* start a thread for every printer, with SIGINT and SIGTERM blocked so
+   that they only interrupt the main thread */
+int start_printers(void)
+{
+	sigset_t block, old;
+	int started=0;
+
+	jobs.stop=false;
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	for (int i=0; i<nprinters; i++) {
+		if (printer_start(&printers[i]) == 0) {
+			started++;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (started < nprinters) {
+		printf(_("could not start print thread\n"));
+		stop_printers();
+		return -1;
+	}
+	return 0;
+}
+
+/* let the printers finish what is queued, then wait for them */
+void stop_printers(void)
+{
+	pthread_mutex_lock(&jobs.lock);
+	jobs.stop=true;
+	pthread_cond_broadcast(&jobs.cond);
+	pthread_mutex_unlock(&jobs.lock);
+	for (int i=0; i<nprinters; i++) {
+		if (printers[i].running) {
+			pthread_join(printers[i].thread, NULL);
+			printers[i].running=false;
+		}
+	}
+}
+
+/* --------------------------------------------------------------------
+	Print one label for every line of file (or stdin for "-"). A line
+	that can not be parsed or printed is reported and skipped.
+   -------------------------------------------------------------------- */
+int run_batch(const char *file)
+{
+	FILE *f=stdin;
+	char *line=NULL, *copy, **words=NULL;
+	const char *err;
+	size_t size=0;
+	unsigned long lineno=0;
+	int n, queued=0, skipped=0;
+
+	if ((strcmp(file, "-") != 0) && ((f=fopen(file, "r")) == NULL)) {
+		printf(_("could not open batch file '%s'\n"), file);
+		return -1;
+	}
+	if (start_printers() != 0) {
+		if (f != stdin) {
+			fclose(f);
+		}
+		return -1;
+	}
+	while (getline(&line, &size, f) >= 0) {
+		lineno++;
+		/* split a copy, the printer splits the line again */
+		if ((copy=strdup(line)) == NULL) {
+			printf(_("out of memory\n"));
+			skipped++;
+			break;
+		}
+		free(words);
+		words=NULL;
+		if ((n=split_line(copy, &words)) < 0) {
+			printf(_("%s:%lu: unbalanced quotes\n"), file, lineno);
+			skipped++;
+		} else if (n > 0) {
+			int min_width=job_min_width(words, n);
+			pthread_mutex_lock(&jobs.lock);
+			if ((err=job_queue(lineno, NULL, line, min_width, true)) != NULL) {
+				printf(_("%s:%lu: %s\n"), file, lineno, err);
+				skipped++;
+			} else {
+				queued++;
+			}
+			pthread_mutex_unlock(&jobs.lock);
+		}
+		free(copy);
+	}
+	stop_printers();
+	if (debug) {
+		printf("debug: %i labels printed, %i skipped\n", queued - jobs.failed, skipped + jobs.failed);
+	}
+	free(words);
+	free(line);
+	if (f != stdin) {
+		fclose(f);
+	}
+	return ((skipped > 0) || (jobs.failed > 0)) ? -1 : 0;
+}
+
+/* --------------------------------------------------------------------
+	Templates: a label given as print-commands, as on a line of a
+	--batch file, whose --text and --barcode data have {column}
+	slots in them, and a CSV file with one record per label. Segments
+	without slots are rendered and turned into printer commands once,
+	for every record only the segments with slots are rendered again.
+   -------------------------------------------------------------------- */
+
+/* a run of segments without slots as printer commands, or one
+   segment with slots */
+struct tmpl_part {
+	uint8_t *data;
+	size_t len;
+	int lines;		/* raster lines in data */
+	struct segment *seg;	/* set for the segment with slots */
+};
+
+struct tmpl {
+	char *text;		/* the template file, split into words */
+	char **words;
+	int nwords;
+	char *header;		/* first line of the CSV file, split into names */
+	char **names;
+	int nnames;
+	struct tmpl_part *part;
+	int nparts;
+	int height;		/* of the label */
+	int offset;		/* of the label on the print head */
+};
+
+int load_template(struct tmpl *t, const char *file)
+{
+	FILE *f;
+	char *line, *end, **w, **tmp;
+	size_t len=0, size=0;
+	int n;
+
+	if ((f=fopen(file, "r")) == NULL) {
+		printf(_("could not open template '%s'\n"), file);
+		return -1;
+	}
+	/* the whole file, the words point into it */
+	for (;;) {
+		if (len + 1 >= size) {
+			size=(size > 0) ? size * 2 : 4096;
+			if ((line=realloc(t->text, size)) == NULL) {
+				printf(_("out of memory\n"));
+				fclose(f);
 				return -1;
 			}
+			t->text=line;
+		}
+		if ((n=(int)fread(t->text + len, 1, size - len - 1, f)) <= 0) {
+			break;
 		}
-		gdImageDestroy(out);
+		len+=(size_t)n;
 	}
-	if (im != NULL) {
-		gdImageDestroy(im);
+	fclose(f);
+	t->text[len]='\0';
+	for (line=t->text; *line != '\0'; line=end) {
+		if ((end=strchr(line, '\n')) != NULL) {
+			*end++='\0';
+		} else {
+			end=line + strlen(line);
+		}
+		if ((n=split_line(line, &w)) < 0) {
+			printf(_("%s: unbalanced quotes\n"), file);
+			return -1;
+		}
+		if (n == 0) {
+			continue;
+		}
+		if ((tmp=realloc(t->words, (size_t)(t->nwords + n + 1) * sizeof(*tmp))) == NULL) {
+			printf(_("out of memory\n"));
+			free(w);
+			return -1;
+		}
+		t->words=tmp;
+		memcpy(t->words + t->nwords, w, (size_t)n * sizeof(*w));
+		t->nwords+=n;
+		t->words[t->nwords]=NULL;
+		free(w);
+	}
+	if (t->nwords == 0) {
+		printf(_("%s: nothing to print\n"), file);
+		return -1;
+	}
+	return 0;
+}
+
+int segment_slots(struct tmpl *t, struct segment *seg)
+{
+	int slots=0;
+
+	if (seg->type == SEG_TEXT) {
+		for (int k=0; k<seg->lines; k++) {
+			slots+=(template_fields(seg->line[k], t->names, t->nnames) > 0);
+		}
+	} else if (seg->type == SEG_BARCODE) {
+		slots+=(template_fields(seg->data, t->names, t->nnames) > 0);
+	}
+	return slots;
+}
+
+/* the printer commands of im, added to a part */
+int encode_part(struct tmpl_part *p, ptouch_dev ptdev, pt_bitmap im, int offset)
+{
+	size_t bpl=ptdev->devinfo->bytes_per_line;
+	uint8_t rasterline[bpl], *tmp;
+
+	if ((tmp=realloc(p->data, p->len + (size_t)im->width * PTOUCH_RASTER_CMD_MAX(bpl))) == NULL) {
+		printf(_("out of memory\n"));
+		return -1;
+	}
+	p->data=tmp;
+	for (int x=0; x<im->width; x++) {
+		if (ptouch_bitmap_rasterline(im, x, rasterline, bpl, offset) != 0) {
+			return -1;
+		}
+		p->len+=ptouch_raster_command(ptdev, rasterline, bpl, p->data + p->len);
+		p->lines++;
+	}
+	return 0;
+}
+
+int compile_template(struct tmpl *t, ptouch_dev ptdev, int tape_width)
+{
+	pt_label label;
+	struct tmpl_part *tmp;
+	struct segment *seg;
+	pt_bitmap im;
+	int k, rc=-1;
+
+	for (int i=0; i<t->nwords; i++) {
+		if ((k=template_fields(t->words[i], t->names, t->nnames)) < 0) {
+			return -1;
+		}
+		/* the size of images and padding has to be known up front */
+		if ((k > 0) && ((i == 0) || (strcmp(t->words[i-1], "--image") == 0) || (strcmp(t->words[i-1], "--pad") == 0)
+			|| (strcmp(t->words[i-1], "--font") == 0) || (strcmp(t->words[i-1], "--fontsize") == 0)
+			|| (strcmp(t->words[i-1], "--barcode") == 0) || (strcmp(t->words[i-1], "--qr-ecc") == 0))) {
+			printf(_("slots can only be used in the text of --text and the data of --barcode\n"));
+			return -1;
+		}
+	}
+	if ((label=ptouch_label_new()) == NULL) {
+		printf(_("out of memory\n"));
+		return -1;
+	}
+	if (build_label(label, t->nwords, t->words, tape_width, ptdev->devinfo->dpi, true) != 0) {
+		goto out;
+	}
+	if (label->nseg == 0) {
+		printf(_("nothing to print\n"));
+		goto out;
+	}
+	if (label->height > tape_width) {
+		printf(_("image is too high (%ipx)\n"), label->height);
+		printf(_("maximum printing width for this tape is %ipx\n"), tape_width);
+		goto out;
+	}
+	t->height=label->height;
+	t->offset=((int)ptouch_get_max_pixel_width(ptdev) / 2) - (label->height / 2);
+	for (int i=0; i<label->nseg; i++) {
+		seg=label->seg[i].ctx;
+		k=segment_slots(t, seg);
+		/* a new part for every text with slots and whatever follows it */
+		if ((k > 0) || (t->nparts == 0) || (t->part[t->nparts - 1].seg != NULL)) {
+			if ((tmp=realloc(t->part, (size_t)(t->nparts + 1) * sizeof(*tmp))) == NULL) {
+				printf(_("out of memory\n"));
+				goto out;
+			}
+			t->part=tmp;
+			memset(&t->part[t->nparts++], 0, sizeof(*tmp));
+		}
+		if (k > 0) {
+			t->part[t->nparts - 1].seg=seg;
+			label->seg[i].ctx=NULL;
+			continue;
+		}
+		if ((im=render_segment(seg)) == NULL) {
+			goto out;
+		}
+		k=encode_part(&t->part[t->nparts - 1], ptdev, im, t->offset + t->height - im->height);
+		ptouch_bitmap_free(im);
+		if (k != 0) {
+			goto out;
+		}
+	}
+	rc=0;
+out:
+	free_label(label);
+	return rc;
+}
+
+/* the label of one record: the prepared commands, with the segments
+   with slots rendered in between */
+int print_record(struct tmpl *t, ptouch_dev ptdev, char **values)
+{
+	size_t bpl=ptdev->devinfo->bytes_per_line;
+	uint8_t rasterline[bpl];
+	char *text[MAX_LINES], **field;
+	struct segment seg;
+	pt_bitmap im;
+	double ts;
+	int k, r, nfields, lines=0;
+
+	if ((ptdev->devinfo->flags & FLAG_RASTER_PACKBITS) == FLAG_RASTER_PACKBITS) {
+		ptouch_enable_packbits(ptdev);
+	}
+	if (ptouch_rasterstart(ptdev) != 0) {
+		printf(_("ptouch_rasterstart() failed\n"));
+		return -1;
+	}
+	if (ptouch_monitor_start(ptdev) != 0) {
+		printf(_("printing without status monitor\n"));
+	}
+	ptouch_page_flags(ptdev, AUTO_CUT | FEED_SMALL);
+	for (int i=0; i<t->nparts; i++) {
+		struct tmpl_part *p=&t->part[i];
+		if (p->seg == NULL) {
+			ts=stats_now();
+			if (ptouch_send(ptdev, p->data, p->len) != 0) {
+				report_abort(ptdev, lines);
+				return -1;
+			}
+			stats_add(STATS_SEND, ts);
+			lines+=p->lines;
+			continue;
+		}
+		seg=*p->seg;
+		/* the slots are in the lines of text or the barcode data */
+		field=(seg.type == SEG_BARCODE) ? &seg.data : seg.line;
+		nfields=(seg.type == SEG_BARCODE) ? 1 : seg.lines;
+		for (k=0; k<nfields; k++) {
+			if ((text[k]=template_expand(field[k], t->names, values, t->nnames)) == NULL) {
+				printf(_("out of memory\n"));
+				break;
+			}
+			field[k]=text[k];
+		}
+		im=(k == nfields) ? render_segment(&seg) : NULL;
+		while (k-- > 0) {
+			free(text[k]);
+		}
+		if (im == NULL) {
+			ptouch_monitor_stop(ptdev);
+			ptouch_reset(ptdev);
+			return -1;
+		}
+		for (int x=0; x<im->width; x++) {
+			ts=stats_now();
+			r=ptouch_bitmap_rasterline(im, x, rasterline, bpl, t->offset + t->height - im->height);
+			stats_add(STATS_RASTER, ts);
+			ts=stats_now();
+			if ((r != 0) || (ptouch_sendraster(ptdev, rasterline, bpl) != 0)) {
+				ptouch_bitmap_free(im);
+				report_abort(ptdev, lines);
+				return -1;
+			}
+			stats_add(STATS_SEND, ts);
+			lines++;
+		}
+		ptouch_bitmap_free(im);
+	}
+	stats_lines(lines, (size_t)lines * bpl);
+	return eject_label(ptdev);
+}
+
+void free_template(struct tmpl *t)
+{
+	for (int i=0; i<t->nparts; i++) {
+		free(t->part[i].data);
+		free(t->part[i].seg);
+	}
+	free(t->part);
+	free(t->names);
+	free(t->header);
+	free(t->words);
+	free(t->text);
+}
+
+int run_template(const char *file, const char *csv)
+{
+	struct tmpl t={ 0 };
+	FILE *f=stdin;
+	char *line=NULL, **values=NULL;
+	size_t size=0;
+	unsigned long lineno=1;
+	int n, printed=0, skipped=0, rc=-1;
+
+	if ((strcmp(csv, "-") != 0) && ((f=fopen(csv, "r")) == NULL)) {
+		printf(_("could not open CSV file '%s'\n"), csv);
+		return -1;
+	}
+	/* the first line names the columns */
+	if ((getline(&t.header, &size, f) < 0) || ((t.nnames=csv_split(t.header, &t.names)) < 0)) {
+		printf(_("%s: no column names\n"), csv);
+		goto out;
+	}
+	if ((load_template(&t, file) != 0) || (compile_template(&t, printers[0].ptdev, printers[0].tape_width) != 0)) {
+		goto out;
+	}
+	size=0;
+	while (getline(&line, &size, f) >= 0) {
+		lineno++;
+		if (line[strspn(line, " \t\r\n")] == '\0') {
+			continue;
+		}
+		free(values);
+		values=NULL;
+		if ((n=csv_split(line, &values)) < 0) {
+			printf(_("%s:%lu: unbalanced quotes\n"), csv, lineno);
+			skipped++;
+		} else if (n != t.nnames) {
+			printf(_("%s:%lu: %i fields instead of %i\n"), csv, lineno, n, t.nnames);
+			skipped++;
+		} else if (print_record(&t, printers[0].ptdev, values) != 0) {
+			/* the printer is in trouble, the other records have to wait */
+			skipped++;
+			break;
+		} else {
+			printed++;
+		}
+	}
+	if (debug) {
+		printf("debug: %i labels printed, %i skipped\n", printed, skipped);
+	}
+	rc=(skipped > 0) ? -1 : 0;
+out:
+	free(values);
+	free(line);
+	free_template(&t);
+	if (f != stdin) {
+		fclose(f);
+	}
+	return rc;
+}
+
+/* --------------------------------------------------------------------
+	Daemon mode: the printers are opened once and labels come from
+	clients of a unix socket. A client sends one label per line, in
+	the same form as a --batch file, and gets back
+		queued <id>
+	right away, and once the label went out either
+		done <id> ok <ms waiting> <ms printing>
+	or	done <id> error <reason>
+	The line "status" is answered with the queue length and the tape
+	status every printer reported when the daemon started.
+   -------------------------------------------------------------------- */
+
+volatile sig_atomic_t daemon_stop=0;
+
+void daemon_signal(int sig)
+{
+	(void)sig;
+	daemon_stop=1;
+}
+
+/* handle one line from a client */
+void daemon_line(struct client *c, char *line, unsigned long *next_id)
+{
+	char *copy, **words=NULL;
+	const char *err;
+	size_t len;
+	int n, min_width;
+
+	while ((*line == ' ') || (*line == '\t')) {
+		line++;
+	}
+	len=strlen(line);
+	if ((len > 0) && (line[len-1] == '\r')) {
+		line[--len]='\0';
+	}
+	if ((len == 0) || (*line == '#')) {
+		return;
+	}
+	if (strcmp(line, "status") == 0) {
+		char msg[256];
+		int pos=0;
+		pthread_mutex_lock(&jobs.lock);
+		msg[0]='\0';
+		for (int i=0; (i < nprinters) && (pos < (int)sizeof(msg)); i++) {
+			struct printer *p=&printers[i];
+			if (p->ptdev == NULL) {
+				continue;
+			}
+			pos+=snprintf(msg + pos, sizeof(msg) - (size_t)pos, " %imm/%ipx/%04x%s", p->ptdev->status->media_width,
+				p->tape_width, p->ptdev->status->error, p->failed ? "/failed" : "");
+		}
+		client_reply(c, "status queued %i%s\n", jobs.len, msg);
+		pthread_mutex_unlock(&jobs.lock);
+		return;
+	}
+	if ((copy=strdup(line)) == NULL) {
+		pthread_mutex_lock(&jobs.lock);
+		client_reply(c, "error out of memory\n");
+		pthread_mutex_unlock(&jobs.lock);
+		return;
+	}
+	n=split_line(copy, &words);
+	min_width=(n > 0) ? job_min_width(words, n) : 0;
+	free(words);
+	free(copy);
+	pthread_mutex_lock(&jobs.lock);
+	if (n < 0) {
+		client_reply(c, "error syntax error\n");
+	} else if ((err=job_queue(*next_id, c, line, min_width, false)) != NULL) {
+		client_reply(c, "error %s\n", err);
+	} else {
+		client_reply(c, "queued %lu\n", (*next_id)++);
+	}
+	pthread_mutex_unlock(&jobs.lock);
+}
+
+/* read from a client and queue every complete line, -1 once it is gone */
+int daemon_read(struct client *c, unsigned long *next_id)
+{
+	ssize_t n;
+	char *nl;
+
+	if ((n=read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len)) <= 0) {
+		return ((n < 0) && (errno == EINTR)) ? 0 : -1;
+	}
+	c->len+=(size_t)n;
+	while ((nl=memchr(c->buf, '\n', c->len)) != NULL) {
+		*nl='\0';
+		daemon_line(c, c->buf, next_id);
+		c->len-=(size_t)(nl + 1 - c->buf);
+		memmove(c->buf, nl + 1, c->len);
+	}
+	if (c->len == sizeof(c->buf)) {
+		pthread_mutex_lock(&jobs.lock);
+		client_reply(c, "error line too long\n");
+		pthread_mutex_unlock(&jobs.lock);
+		return -1;
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	With --hotplug the daemon starts without printers. A thread of
+	its own takes them as libusb reports and opens them and retires
+	the ones that are unplugged, so the bus is never enumerated again.
+   -------------------------------------------------------------------- */
+void attach_printer(ptouch_dev ptdev)
+{
+	struct printer *p=NULL;
+	ptouch_dev old=NULL;
+	double t;
+	int r;
+
+	t=stats_now();
+	if (ptouch_init(ptdev) != 0) {
+		printf(_("ptouch_init() failed\n"));
+	}
+	stats_add(STATS_INIT, t);
+	t=stats_now();
+	r=ptouch_getstatus(ptdev);
+	stats_add(STATS_STATUS, t);
+	if (r != 0) {
+		printf(_("ptouch_getstatus() failed\n"));
+		ptouch_close(ptdev);
+		return;
+	}
+	pthread_mutex_lock(&jobs.lock);
+	/* reuse the slot of a printer that is gone */
+	for (int i=0; (i < nprinters) && (p == NULL); i++) {
+		if (printers[i].failed) {
+			p=&printers[i];
+		}
+	}
+	if ((p == NULL) && (nprinters < MAX_PRINTERS)) {
+		p=&printers[nprinters];
+	}
+	pthread_mutex_unlock(&jobs.lock);
+	if (p == NULL) {
+		printf(_("too many printers, ignoring %s\n"), ptdev->devinfo->name);
+		ptouch_close(ptdev);
+		return;
+	}
+	/* the old thread may still be printing its last job on the old device */
+	if (p->running) {
+		pthread_join(p->thread, NULL);
+		p->running=false;
+	}
+	pthread_mutex_lock(&jobs.lock);
+	old=p->ptdev;
+	p->ptdev=NULL;
+	pthread_mutex_unlock(&jobs.lock);
+	if (old != NULL) {
+		ptouch_close(old);
+	}
+	pthread_mutex_lock(&jobs.lock);
+	p->ptdev=ptdev;
+	p->tape_width=ptouch_get_tape_pixel_width(ptdev);
+	p->failed=false;
+	if (p == &printers[nprinters]) {
+		nprinters++;
+	}
+	if (printer_start(p) != 0) {
+		printf(_("could not start print thread\n"));
+	} else {
+		printf(_("printer %i: %s with %imm tape\n"), (int)(p - printers) + 1, ptdev->devinfo->name,
+			ptdev->status->media_width);
+	}
+	pthread_mutex_unlock(&jobs.lock);
+}
+
+void detach_printer(pt_selector where)
+{
+	struct printer *p=NULL;
+	ptouch_dev old;
+
+	pthread_mutex_lock(&jobs.lock);
+	for (int i=0; (i < nprinters) && (p == NULL); i++) {
+		if (printers[i].failed || (printers[i].ptdev == NULL) || (printers[i].ptdev->bus != where->bus)
+			|| (printers[i].ptdev->addr != where->addr)) {
+			continue;
+		}
+		printf(_("printer %i was unplugged\n"), i + 1);
+		p=&printers[i];
+		p->failed=true;
+		job_purge();
+		pthread_cond_broadcast(&jobs.cond);
+	}
+	pthread_mutex_unlock(&jobs.lock);
+	if (p == NULL) {
+		return;
+	}
+	/* close the device as soon as its thread is done with it */
+	if (p->running) {
+		pthread_join(p->thread, NULL);
+		p->running=false;
+	}
+	pthread_mutex_lock(&jobs.lock);
+	old=p->ptdev;
+	p->ptdev=NULL;
+	pthread_mutex_unlock(&jobs.lock);
+	if (old != NULL) {
+		ptouch_close(old);
+	}
+}
+
+void *hotplug_worker(void *arg)
+{
+	pt_hotplug hp=arg;
+	struct _pt_selector where;
+	ptouch_dev ptdev;
+	bool stop=false;
+
+	while (!stop) {
+		switch (ptouch_hotplug_wait(hp, 500, &where, &ptdev)) {
+		case PT_HOTPLUG_ARRIVED:
+			if (ptdev != NULL) {
+				attach_printer(ptdev);
+			}
+			break;
+		case PT_HOTPLUG_LEFT:
+			detach_printer(&where);
+			break;
+		case -1:
+			return NULL;
+		}
+		pthread_mutex_lock(&jobs.lock);
+		stop=jobs.stop;
+		pthread_mutex_unlock(&jobs.lock);
+	}
+	return NULL;
+}
+
+int run_daemon(const char *path)
+{
+	struct sockaddr_un addr={ .sun_family=AF_UNIX };
+	struct pollfd pfd[DAEMON_MAX_CLIENTS + 1];
+	struct client *client[DAEMON_MAX_CLIENTS];
+	struct sigaction sa={ .sa_handler=daemon_signal };
+	pt_hotplug hp=NULL;
+	pthread_t hotplug_thread;
+	sigset_t block, old;
+	unsigned long next_id=1;
+	int lfd, nclients=0;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf(_("socket path '%s' is too long\n"), path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((lfd=socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		printf(_("could not create socket: %s\n"), strerror(errno));
+		return -1;
+	}
+	unlink(path);	/* left over from an earlier run */
+	if ((bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(lfd, 16) != 0)) {
+		printf(_("could not listen on '%s': %s\n"), path, strerror(errno));
+		close(lfd);
+		return -1;
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);	/* our log may go to a file */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	if (start_printers() != 0) {
+		close(lfd);
+		unlink(path);
+		return -1;
+	}
+	if (hotplug) {
+		sigemptyset(&block);
+		sigaddset(&block, SIGINT);
+		sigaddset(&block, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &block, &old);
+		if (((hp=ptouch_hotplug_start()) == NULL) || (pthread_create(&hotplug_thread, NULL, hotplug_worker, hp) != 0)) {
+			printf(_("could not start hotplug thread\n"));
+			ptouch_hotplug_stop(hp);
+			hp=NULL;
+			daemon_stop=1;
+		}
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
 	}
-	ptouch_close(ptdev);
-	libusb_exit(NULL);
+	printf(ngettext("waiting for labels on %s for %i printer\n",
+		"waiting for labels on %s for %i printers\n", (unsigned long)nprinters), path, nprinters);
+	while (!daemon_stop) {
+		pfd[0].fd=lfd;
+		pfd[0].events=POLLIN;
+		for (int i=0; i<nclients; i++) {
+			pfd[i+1].fd=client[i]->fd;
+			pfd[i+1].events=POLLIN;
+		}
+		if (poll(pfd, (nfds_t)nclients + 1, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf(_("poll() failed: %s\n"), strerror(errno));
+			break;
+		}
+		/* backwards, so the client moved into a free slot was already handled */
+		for (int i=nclients-1; i>=0; i--) {
+			if (pfd[i+1].revents == 0) {
+				continue;
+			}
+			if (daemon_read(client[i], &next_id) != 0) {
+				pthread_mutex_lock(&jobs.lock);
+				client_release(client[i]);
+				pthread_mutex_unlock(&jobs.lock);
+				client[i]=client[--nclients];
+			}
+		}
+		if (pfd[0].revents & POLLIN) {
+			int fd=accept(lfd, NULL, NULL);
+			struct client *c;
+			if (fd < 0) {
+				continue;
+			}
+			if ((nclients == DAEMON_MAX_CLIENTS) || ((c=malloc(sizeof(*c))) == NULL)) {
+				close(fd);
+				continue;
+			}
+			c->fd=fd;
+			c->refs=1;
+			c->len=0;
+			client[nclients++]=c;
+		}
+	}
+	/* print what is queued already, then stop */
+	if (hp != NULL) {
+		pthread_mutex_lock(&jobs.lock);
+		jobs.stop=true;
+		pthread_mutex_unlock(&jobs.lock);
+		pthread_join(hotplug_thread, NULL);
+		ptouch_hotplug_stop(hp);
+	}
+	stop_printers();
+	for (int i=0; i<nclients; i++) {
+		client_release(client[i]);
+	}
+	close(lfd);
+	unlink(path);
 	return 0;
 }
+
+/* --------------------------------------------------------------------
+	Open the first printer or the one given with --printer, or with
+	--all-printers every one that is attached and reports its status.
+	With --capture or --replay there is no printer at all.
+	Returns the number opened.
+   -------------------------------------------------------------------- */
+int open_printers(void)
+{
+	ptouch_dev *devs=NULL;
+	int n, r;
+	double t=stats_now();
+
+	if ((capture_file != NULL) || (replay_file != NULL)) {
+		if ((devs=malloc(sizeof(*devs))) == NULL) {
+			return 0;
+		}
+		if (replay_file != NULL) {
+			r=ptouch_open_replay(&devs[0], CAPTURE_PID, replay_file, capture_file);
+		} else {
+			r=ptouch_open_capture(&devs[0], CAPTURE_PID, CAPTURE_TAPE_MM, capture_file);
+		}
+		if (r != 0) {
+			free(devs);
+			return 0;
+		}
+		n=1;
+	} else if (all_printers) {
+		if ((n=ptouch_open_all(&devs)) <= 0) {
+			return 0;
+		}
+	} else {
+		if ((devs=malloc(sizeof(*devs))) == NULL) {
+			return 0;
+		}
+		if (ptouch_open_sel(&devs[0], have_sel ? &printer_sel : NULL) < 0) {
+			free(devs);
+			return 0;
+		}
+		n=1;
+	}
+	stats_add(STATS_OPEN, t);
+	for (int i=0; i<n; i++) {
+		t=stats_now();
+		if (ptouch_init(devs[i]) != 0) {
+			printf(_("ptouch_init() failed\n"));
+		}
+		stats_add(STATS_INIT, t);
+		t=stats_now();
+		r=ptouch_getstatus(devs[i]);
+		stats_add(STATS_STATUS, t);
+		if (r != 0) {
+			printf(_("ptouch_getstatus() failed\n"));
+			ptouch_close(devs[i]);
+			continue;
+		}
+		if (nprinters == MAX_PRINTERS) {
+			printf(_("too many printers, ignoring %s\n"), devs[i]->devinfo->name);
+			ptouch_close(devs[i]);
+			continue;
+		}
+		printers[nprinters].ptdev=devs[i];
+		printers[nprinters].tape_width=ptouch_get_tape_pixel_width(devs[i]);
+		nprinters++;
+	}
+	free(devs);
+	return nprinters;
+}
+
+/* --stats and --stats-json, with the transfers of all printers added up */
+void report_stats(void)
+{
+	struct _pt_xfer_stats xs={ 0 };
+	FILE *f;
+
+	for (int i=0; i<nprinters; i++) {
+		struct _pt_xfer_stats *st;
+		if (printers[i].ptdev == NULL) {
+			continue;
+		}
+		st=ptouch_get_xfer_stats(printers[i].ptdev);
+		xs.bytes+=st->bytes;
+		xs.commands+=st->commands;
+		xs.completed+=st->completed;
+	}
+	if (show_stats) {
+		stats_report(stdout, &xs, false);
+	}
+	if (stats_json != NULL) {
+		if ((f=fopen(stats_json, "w")) == NULL) {
+			printf(_("writing '%s' failed\n"), stats_json);
+			return;
+		}
+		stats_report(f, &xs, true);
+		fclose(f);
+	}
+}
+
+void close_printers(void)
+{
+	for (int i=0; i<nprinters; i++) {
+		if (printers[i].ptdev != NULL) {
+			ptouch_close(printers[i].ptdev);
+			printers[i].ptdev=NULL;
+		}
+	}
+	nprinters=0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, rc=0;
+	pt_label label=NULL;
+
+	setlocale(LC_ALL, "");
+	bindtextdomain(PACKAGE, LOCALEDIR);
+	textdomain(PACKAGE);
+	i=parse_args(argc, argv);
+	if (i != argc) {
+		usage(argv[0]);
+	}
+	if (show_stats || (stats_json != NULL)) {
+		stats_enable();
+	}
+	if ((job_cache != NULL) && (jobcache_open(job_cache, (size_t)((job_cache_size > 0) ? job_cache_size : JOBCACHE_SIZE) << 20) != 0)) {
+		return 1;
+	}
+	if (((batch_file != NULL) || (daemon_socket != NULL) || (template_file != NULL)) && (save_png != NULL)) {
+		printf(_("--writepng can not be used with --batch, --daemon or --template\n"));
+		return 1;
+	}
+	if ((font_cache != NULL) && (text_cache_open(font_cache) != 0)) {
+		printf(_("out of memory\n"));
+		return 1;
+	}
+	/* gd has to set up its font cache before text is rendered on threads */
+	if (gdFontCacheSetup() != 0) {
+		printf(_("could not set up the font cache\n"));
+		return 1;
+	}
+	/* segments of a label are rendered on all cores, by one set of
+	   threads shared by all printers */
+	if ((render_pool=ptouch_render_pool_new((int)sysconf(_SC_NPROCESSORS_ONLN))) == NULL) {
+		printf(_("out of memory\n"));
+		return 1;
+	}
+	/* with --hotplug the printers are opened as they show up */
+	if (!hotplug && (open_printers() == 0)) {
+		return 5;
+	}
+	if (show_info) {
+		for (i=0; i<nprinters; i++) {
+			ptouch_dev ptdev=printers[i].ptdev;
+			if (nprinters > 1) {
+				printf("%s:\n", ptdev->devinfo->name);
+			}
+			printf(_("maximum printing width for this tape is %ipx\n"), printers[i].tape_width);
+			printf("media type = %02x\n", ptdev->status->media_type);
+			printf("media width = %d mm\n", ptdev->status->media_width);
+			printf("tape color = %02x\n", ptdev->status->tape_color);
+			printf("text color = %02x\n", ptdev->status->text_color);
+			printf("error = %04x\n", ptdev->status->error);
+		}
+		exit(0);
+	}
+	if (batch_file != NULL) {
+		rc=(run_batch(batch_file) != 0);
+	} else if (daemon_socket != NULL) {
+		rc=(run_daemon(daemon_socket) != 0);
+	} else if (template_file != NULL) {
+		rc=(run_template(template_file, csv_file) != 0);
+	} else {
+		if ((label=ptouch_label_new()) == NULL) {
+			printf(_("out of memory\n"));
+			return 1;
+		}
+		if (build_label(label, argc-1, argv+1, printers[0].tape_width, printers[0].ptdev->devinfo->dpi, false) != 0) {
+			free_label(label);
+			return 1;
+		}
+		if ((label->nseg > 0) && (print_label(printers[0].ptdev, label) != 0)) {
+			rc=1;
+		}
+		free_label(label);
+	}
+	for (i=0; debug && (save_png == NULL) && (i < nprinters); i++) {
+		struct _pt_xfer_stats *st=ptouch_get_xfer_stats(printers[i].ptdev);
+		printf("debug: printer %i: %lu commands, %lu transfers (%zu bytes), queue depth %i, max %i in flight\n", i + 1,
+			st->commands, st->completed, st->bytes, ptouch_get_queue_depth(printers[i].ptdev), st->max_inflight);
+		if (st->completed > 0) {
+			printf("debug: printer %i: transfer latency min %.2f ms, avg %.2f ms, max %.2f ms\n", i + 1,
+				st->latency_min * 1000, st->latency_sum * 1000 / (double)st->completed, st->latency_max * 1000);
+		}
+	}
+	if (show_stats || (stats_json != NULL)) {
+		report_stats();
+	}
+	if ((font_cache != NULL) && (text_cache_save() != 0)) {
+		printf(_("could not write font cache '%s'\n"), font_cache);
+	}
+	ptouch_render_pool_free(render_pool);
+	text_cache_clear();
+	close_printers();
+	return rc;
+}
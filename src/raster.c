@@ -0,0 +1,315 @@
+/*
+	libptouch - raster conversion helpers and 1bpp label bitmaps
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdint.h>
+#include <stdlib.h>	/* malloc(), calloc(), free() */
+#include <string.h>	/* memcpy() */
+#ifdef __SSE2__
+#include <emmintrin.h>	/* _mm_cmpeq_epi8(), _mm_movemask_epi8() */
+#endif
+#include "ptouch.h"
+
+/* Pack a row of 8 bit pixels into 1bpp: bit k of dst[b] is set when
+   src[8*b+k] equals ink. dst must hold (width+7)/8 bytes. */
+void ptouch_pack_8bpp(uint8_t *dst, const uint8_t *src, int width, uint8_t ink)
+{
+	int x=0;
+
+#ifdef __SSE2__
+	const __m128i v=_mm_set1_epi8((char)ink);
+	for (; x+16 <= width; x+=16) {
+		int m=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(src + x)), v));
+		dst[x/8]=(uint8_t)m;
+		dst[x/8 + 1]=(uint8_t)(m >> 8);
+	}
+#elif defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	const uint64_t lo7=UINT64_C(0x7f7f7f7f7f7f7f7f);
+	const uint64_t pattern=ink * UINT64_C(0x0101010101010101);
+	for (; x+8 <= width; x+=8) {
+		uint64_t w, z;
+		memcpy(&w, src + x, sizeof(w));
+		w^=pattern;
+		z=~(((w & lo7) + lo7) | w | lo7);	/* 0x80 in every byte equal to ink */
+		dst[x/8]=(uint8_t)(((z >> 7) * UINT64_C(0x0102040810204080)) >> 56);
+	}
+#endif
+	for (; x < width; x+=8) {
+		uint8_t b=0;
+		for (int k=0; (k < 8) && (x + k < width); k++) {
+			if (src[x + k] == ink) {
+				b|=(uint8_t)(1 << k);
+			}
+		}
+		dst[x/8]=b;
+	}
+}
+
+/* transpose an 8x8 bit matrix held in a word, byte j bit k <-> byte k bit j
+   (Hacker's Delight, section 7-3) */
+static inline uint64_t transpose8(uint64_t x)
+{
+	uint64_t t;
+
+	t=(x ^ (x >> 7)) & UINT64_C(0x00aa00aa00aa00aa);
+	x=x ^ t ^ (t << 7);
+	t=(x ^ (x >> 14)) & UINT64_C(0x0000cccc0000cccc);
+	x=x ^ t ^ (t << 14);
+	t=(x ^ (x >> 28)) & UINT64_C(0x00000000f0f0f0f0);
+	x=x ^ t ^ (t << 28);
+	return x;
+}
+
+/* Turn columns x0 .. x0+width-1 of a row-major 1bpp image (as produced by
+   ptouch_pack_8bpp(), x0 must be a multiple of 8) into column bit strings.
+   Bit p of column c (byte p/8, bit p%8 of cols + c*stride) is ORed with
+   pixel (x0+c, height-1-(p-offset)), so the bottom image row lands at bit
+   offset. This is the order raster lines are sent in, just with the bytes
+   reversed. Works on 8x8 blocks so every input byte is read only once. */
+void ptouch_transpose(uint8_t *cols, size_t stride, const uint8_t *const *rows, int x0, int width, int height, int offset)
+{
+	for (int xb=0; xb < width; xb+=8) {
+		int ncol=(width - xb < 8) ? width - xb : 8;
+		int b=(x0 + xb) / 8;
+		for (int p=offset & ~7; p < offset + height; p+=8) {
+			uint64_t m=0;
+			for (int j=0; j < 8; j++) {
+				int i=p + j - offset;
+				if ((i >= 0) && (i < height)) {
+					m|=(uint64_t)rows[height - 1 - i][b] << (8 * j);
+				}
+			}
+			if (m == 0) {
+				continue;
+			}
+			m=transpose8(m);
+			for (int c=0; c < ncol; c++) {
+				cols[(size_t)(xb + c) * stride + (size_t)(p / 8)]|=(uint8_t)(m >> (8 * c));
+			}
+		}
+	}
+}
+
+/* allocate a blank bitmap, width columns of height pixels each */
+pt_bitmap ptouch_bitmap_new(int width, int height)
+{
+	pt_bitmap bm;
+
+	if ((width < 0) || (height < 0)) {
+		return NULL;
+	}
+	if ((bm=malloc(sizeof(struct _pt_bitmap))) == NULL) {
+		return NULL;
+	}
+	bm->width=width;
+	bm->height=height;
+	bm->stride=((size_t)height + 7) / 8;
+	/* one spare column used by ptouch_bitmap_mirror() */
+	if ((bm->data=calloc((size_t)width + 1, bm->stride)) == NULL) {
+		free(bm);
+		return NULL;
+	}
+	return bm;
+}
+
+void ptouch_bitmap_free(pt_bitmap bm)
+{
+	if (bm == NULL) {
+		return;
+	}
+	free(bm->data);
+	free(bm);
+}
+
+/* build a bitmap from row-major 1bpp rows as written by ptouch_pack_8bpp() */
+pt_bitmap ptouch_bitmap_from_rows(const uint8_t *const *rows, int width, int height)
+{
+	pt_bitmap bm;
+
+	if ((bm=ptouch_bitmap_new(width, height)) == NULL) {
+		return NULL;
+	}
+	ptouch_transpose(bm->data, bm->stride, rows, 0, width, height, 0);
+	return bm;
+}
+
+int ptouch_bitmap_get(pt_bitmap bm, int x, int y)
+{
+	size_t i;
+
+	if ((x < 0) || (y < 0) || (x >= bm->width) || (y >= bm->height)) {
+		return 0;
+	}
+	i=(size_t)(bm->height - 1 - y);
+	return (bm->data[(size_t)x * bm->stride + i / 8] >> (i % 8)) & 1;
+}
+
+void ptouch_bitmap_set(pt_bitmap bm, int x, int y, int v)
+{
+	size_t i;
+	uint8_t *p;
+
+	if ((x < 0) || (y < 0) || (x >= bm->width) || (y >= bm->height)) {
+		return;
+	}
+	i=(size_t)(bm->height - 1 - y);
+	p=&bm->data[(size_t)x * bm->stride + i / 8];
+	if (v) {
+		*p|=(uint8_t)(1 << (i % 8));
+	} else {
+		*p&=(uint8_t)~(1 << (i % 8));
+	}
+}
+
+/* 8 bits of a column starting at bit pos, bits outside the column read as 0 */
+static uint8_t column_get8(const uint8_t *col, size_t nbytes, long pos)
+{
+	size_t i;
+	int r;
+	unsigned v;
+
+	if (pos <= -8) {
+		return 0;
+	}
+	if (pos < 0) {
+		return (uint8_t)(col[0] << -pos);
+	}
+	i=(size_t)pos / 8;
+	r=(int)(pos % 8);
+	v=(i < nbytes) ? col[i] : 0;
+	if ((r != 0) && (i + 1 < nbytes)) {
+		v|=(unsigned)col[i + 1] << 8;
+	}
+	return (uint8_t)(v >> r);
+}
+
+/* mask of the bits of byte b that fall into [lo, hi) */
+static uint8_t byte_mask(long b, long lo, long hi)
+{
+	long first=b * 8, last=b * 8 + 8;
+
+	if (lo > first) {
+		first=lo;
+	}
+	if (hi < last) {
+		last=hi;
+	}
+	if (first >= last) {
+		return 0;
+	}
+	return (uint8_t)(((1u << (last - first)) - 1) << (first - b * 8));
+}
+
+static void bitmap_combine(pt_bitmap dst, int dx, int dy, pt_bitmap src, int op_or)
+{
+	/* src bit i lands on dst bit i+shift */
+	long shift=(long)dst->height - src->height - dy;
+	long lo=(shift > 0) ? shift : 0;
+	long hi=(shift + src->height < dst->height) ? shift + src->height : dst->height;
+
+	if (lo >= hi) {
+		return;
+	}
+	for (int x=0; x < src->width; x++) {
+		uint8_t *d;
+		const uint8_t *s;
+		if ((dx + x < 0) || (dx + x >= dst->width)) {
+			continue;
+		}
+		d=dst->data + (size_t)(dx + x) * dst->stride;
+		s=src->data + (size_t)x * src->stride;
+		for (long b=lo / 8; b < (hi + 7) / 8; b++) {
+			uint8_t m=byte_mask(b, lo, hi);
+			uint8_t v=column_get8(s, src->stride, b * 8 - shift) & m;
+			d[b]=op_or ? (uint8_t)(d[b] | v) : (uint8_t)((d[b] & ~m) | v);
+		}
+	}
+}
+
+/* copy src into dst with its top left corner at (dx,dy), clipped to dst */
+void ptouch_bitmap_blit(pt_bitmap dst, int dx, int dy, pt_bitmap src)
+{
+	bitmap_combine(dst, dx, dy, src, 0);
+}
+
+/* like ptouch_bitmap_blit(), but set pixels of dst stay set */
+void ptouch_bitmap_or(pt_bitmap dst, int dx, int dy, pt_bitmap src)
+{
+	bitmap_combine(dst, dx, dy, src, 1);
+}
+
+/* set or clear a w x h rectangle with its top left corner at (x,y) */
+void ptouch_bitmap_fill(pt_bitmap bm, int x, int y, int w, int h, int v)
+{
+	long lo, hi;
+
+	if (x < 0) {
+		w+=x;
+		x=0;
+	}
+	if (y < 0) {
+		h+=y;
+		y=0;
+	}
+	if (x + w > bm->width) {
+		w=bm->width - x;
+	}
+	if (y + h > bm->height) {
+		h=bm->height - y;
+	}
+	if ((w <= 0) || (h <= 0)) {
+		return;
+	}
+	lo=(long)bm->height - y - h;
+	hi=(long)bm->height - y;
+	for (int c=x; c < x + w; c++) {
+		uint8_t *d=bm->data + (size_t)c * bm->stride;
+		for (long b=lo / 8; b < (hi + 7) / 8; b++) {
+			uint8_t m=byte_mask(b, lo, hi);
+			d[b]=v ? (uint8_t)(d[b] | m) : (uint8_t)(d[b] & ~m);
+		}
+	}
+}
+
+/* reverse the column order, i.e. mirror along the tape */
+void ptouch_bitmap_mirror(pt_bitmap bm)
+{
+	uint8_t *tmp=bm->data + (size_t)bm->width * bm->stride;	/* spare column */
+
+	for (int a=0, b=bm->width - 1; a < b; a++, b--) {
+		memcpy(tmp, bm->data + (size_t)a * bm->stride, bm->stride);
+		memcpy(bm->data + (size_t)a * bm->stride, bm->data + (size_t)b * bm->stride, bm->stride);
+		memcpy(bm->data + (size_t)b * bm->stride, tmp, bm->stride);
+	}
+}
+
+/* Fill a raster line of bpl bytes from column x, the bottom pixel of the
+   bitmap going to printer pixel offset. Returns -1 if it does not fit. */
+int ptouch_bitmap_rasterline(pt_bitmap bm, int x, uint8_t *line, size_t bpl, int offset)
+{
+	const uint8_t *col;
+	long lo=offset, hi=(long)offset + bm->height;
+
+	if ((offset < 0) || ((size_t)hi > bpl * 8) || (x < 0) || (x >= bm->width)) {
+		return -1;
+	}
+	col=bm->data + (size_t)x * bm->stride;
+	for (size_t b=0; b < bpl; b++) {
+		uint8_t m=byte_mask((long)b, lo, hi);
+		line[bpl - 1 - b]=m ? (uint8_t)(column_get8(col, bm->stride, (long)b * 8 - offset) & m) : 0;
+	}
+	return 0;
+}
@@ -0,0 +1,385 @@
+/*
+	ptouch-print - Print labels with images or text on a Brother P-Touch
+
+	Copyright (C) 2015-2019 Dominic Radermacher <blip@mockmoon-cybernetics.ch>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef USING_CMAKE
+#include "config.h"
+#endif
+
+#include <stdio.h>	/* printf() */
+#include <stdlib.h>	/* malloc() */
+#include <stdbool.h>
+#include <string.h>	/* memcmp(), memset(), strpbrk() */
+#include <gd.h>
+#include "gettext.h"	/* gettext(), ngettext() */
+#include "ptouch.h"
+#include "text.h"
+#include "render.h"
+#include "stats.h"
+
+#define _(s) gettext(s)
+
+/* --------------------------------------------------------------------
+	Convert a gd image to a 1bpp bitmap. In a two colour image the
+	darker of the two colours is printed, as it always was, in any
+	other image every pixel darker than 50% grey (and not transparent)
+   -------------------------------------------------------------------- */
+pt_bitmap bitmap_from_gd(gdImage *im)
+{
+	int x, y, c;
+	uint8_t ink[gdMaxColors];
+	uint8_t tmp[gdImageSX(im)];
+	size_t rowbytes=((size_t)gdImageSX(im) + 7) / 8;
+	uint8_t *bits;
+	const uint8_t **rows;
+	pt_bitmap bm;
+
+	bits=calloc(rowbytes, (size_t)gdImageSY(im) + 1);
+	rows=malloc(((size_t)gdImageSY(im) + 1) * sizeof(*rows));
+	if ((bits == NULL) || (rows == NULL)) {
+		free(bits);
+		free(rows);
+		return NULL;
+	}
+	if (!gdImageTrueColor(im) && (gdImageColorsTotal(im) == 2)) {
+		/* find out whether color 0 or color 1 is darker */
+		c=(gdImageRed(im,1)+gdImageGreen(im,1)+gdImageBlue(im,1) < gdImageRed(im,0)+gdImageGreen(im,0)+gdImageBlue(im,0))?1:0;
+		memset(ink, 0, sizeof(ink));
+		ink[c]=1;
+	} else if (!gdImageTrueColor(im)) {
+		for (c=0; c<gdMaxColors; c++) {
+			ink[c]=(c < gdImageColorsTotal(im)) && (c != im->transparent) &&
+				(gdImageRed(im, c) + gdImageGreen(im, c) + gdImageBlue(im, c) < 3 * 128);
+		}
+	}
+	for (y=0; y<gdImageSY(im); y++) {
+		rows[y]=bits + (size_t)y * rowbytes;
+		for (x=0; x<gdImageSX(im); x++) {
+			if (gdImageTrueColor(im)) {
+				c=gdImageTrueColorPixel(im, x, y);
+				tmp[x]=(gdTrueColorGetAlpha(c) < 64) &&
+					(gdTrueColorGetRed(c) + gdTrueColorGetGreen(c) + gdTrueColorGetBlue(c) < 3 * 128);
+			} else {
+				tmp[x]=ink[gdImagePalettePixel(im, x, y)];
+			}
+		}
+		ptouch_pack_8bpp((uint8_t *)rows[y], tmp, gdImageSX(im), 1);
+	}
+	bm=ptouch_bitmap_from_rows(rows, gdImageSX(im), gdImageSY(im));
+	free(bits);
+	free(rows);
+	return bm;
+}
+
+gdImage *bitmap_to_gd(pt_bitmap bm)
+{
+	gdImage *im;
+
+	if ((im=gdImageCreatePalette(bm->width, bm->height)) == NULL) {
+		return NULL;
+	}
+	gdImageColorAllocate(im, 255, 255, 255);
+	gdImageColorAllocate(im, 0, 0, 0);
+	for (int y=0; y<bm->height; y++) {
+		for (int x=0; x<bm->width; x++) {
+			gdImagePalettePixel(im, x, y)=(unsigned char)ptouch_bitmap_get(bm, x, y);
+		}
+	}
+	return im;
+}
+
+/* tell why a job stopped early and how far it got, then reset the
+   printer so that it does not wait for the rest of the job */
+void report_abort(ptouch_dev ptdev, int lines)
+{
+	int err=ptouch_monitor_error(ptdev);
+
+	ptouch_monitor_stop(ptdev);
+	if (err > 0) {
+		printf(_("printer reported error %04x after %i raster lines\n"), err, lines);
+	} else if (err < 0) {
+		printf(_("printer reported an error after %i raster lines\n"), lines);
+	} else {
+		printf(_("ptouch_sendraster() failed\n"));
+	}
+	ptouch_reset(ptdev);
+}
+
+int print_img(ptouch_dev ptdev, pt_label im)
+{
+	int k,offset,tape_width,lines=0;
+	uint8_t rasterline[ptdev->devinfo->bytes_per_line];
+	double t;
+
+	if ((!im) || (im->nseg == 0)) {
+		printf(_("nothing to print\n"));
+		return -1;
+	}
+	tape_width=ptouch_get_tape_pixel_width(ptdev);
+	if (im->height > tape_width) {
+		printf(_("image is too high (%ipx)\n"), im->height);
+		printf(_("maximum printing width for this tape is %ipx\n"), tape_width);
+		return -1;
+	}
+	size_t max_pixels=ptouch_get_max_pixel_width(ptdev);
+	offset=((int)max_pixels / 2)-(im->height/2);	/* always print centered  */
+	if ((ptdev->devinfo->flags & FLAG_RASTER_PACKBITS) == FLAG_RASTER_PACKBITS) {
+		if (debug) {
+			printf("enable PackBits mode\n");
+		}
+	        ptouch_enable_packbits(ptdev);
+	}
+	if (ptouch_rasterstart(ptdev) != 0) {
+		printf(_("ptouch_rasterstart() failed\n"));
+		return -1;
+	}
+	/* without the monitor errors are only noticed once all is sent */
+	if (ptouch_monitor_start(ptdev) != 0) {
+		printf(_("printing without status monitor\n"));
+	}
+	ptouch_page_flags(ptdev, AUTO_CUT | FEED_SMALL);
+	/* segments are rendered one after the other while the lines of the
+	   previous ones are already on their way to the printer */
+	ptouch_label_rewind(im);
+	for (;;) {
+		/* rendering is timed by render_segment(), only the conversion
+		   to a raster line counts here */
+		if ((k=ptouch_label_ready(im)) <= 0) {
+			break;
+		}
+		t=stats_now();
+		k=ptouch_label_next_rasterline(im, rasterline, sizeof(rasterline), offset);
+		stats_add(STATS_RASTER, t);
+		if (k <= 0) {
+			break;
+		}
+		t=stats_now();
+		if (ptouch_sendraster(ptdev, rasterline, sizeof(rasterline)) != 0) {
+			report_abort(ptdev, lines);
+			return -1;
+		}
+		stats_add(STATS_SEND, t);
+		lines++;
+	}
+	stats_lines(lines, (size_t)lines * sizeof(rasterline));
+	if (k < 0) {
+		ptouch_monitor_stop(ptdev);
+		ptouch_reset(ptdev);
+	}
+	return k;
+}
+
+/* send a label recorded from an earlier print_img() again */
+int print_stream(ptouch_dev ptdev, const uint8_t *data, size_t len)
+{
+	double t;
+	int err;
+
+	if (ptouch_monitor_start(ptdev) != 0) {
+		printf(_("printing without status monitor\n"));
+	}
+	t=stats_now();
+	if (ptouch_send(ptdev, (uint8_t *)data, len) != 0) {
+		err=ptouch_monitor_error(ptdev);
+		ptouch_monitor_stop(ptdev);
+		if (err > 0) {
+			printf(_("printer reported error %04x\n"), err);
+		}
+		printf(_("sending the cached label failed\n"));
+		ptouch_reset(ptdev);
+		return -1;
+	}
+	stats_add(STATS_SEND, t);
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Function	image_load()
+	Description	detect the type of a image and try to load it
+	Last update	2005-10-16
+	Status		Working, should add debug info
+   -------------------------------------------------------------------- */
+
+pt_bitmap image_load(const char *file)
+{
+	const uint8_t png[8]={0x89,'P','N','G',0x0d,0x0a,0x1a,0x0a};
+	char d[10];
+	FILE *f;
+	gdImage *img=NULL;
+	pt_bitmap bm=NULL;
+
+	if ((f = fopen(file, "rb")) == NULL) {	/* error cant open file */
+		return NULL;
+	}
+	if (fread(d, sizeof(d), 1, f) != 1) {
+		return NULL;
+	}
+	rewind(f);
+	if (memcmp(d, png, 8) == 0) {
+		img=gdImageCreateFromPng(f);
+	}
+	fclose(f);
+	if (img != NULL) {
+		bm=bitmap_from_gd(img);
+		gdImageDestroy(img);
+	}
+	return bm;
+}
+
+/* read the height of a PNG image from its IHDR chunk without decoding it */
+int image_height(const char *file)
+{
+	const uint8_t png[8]={0x89,'P','N','G',0x0d,0x0a,0x1a,0x0a};
+	uint8_t d[24];
+	FILE *f;
+
+	if ((f = fopen(file, "rb")) == NULL) {
+		return -1;
+	}
+	if (fread(d, sizeof(d), 1, f) != 1) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	if ((memcmp(d, png, 8) != 0) || (memcmp(d + 12, "IHDR", 4) != 0)) {
+		return -1;
+	}
+	return (d[20] << 24) | (d[21] << 16) | (d[22] << 8) | d[23];
+}
+
+int write_png(pt_bitmap bm, const char *file)
+{
+	FILE *f;
+	gdImage *im;
+
+	if ((im=bitmap_to_gd(bm)) == NULL) {
+		return -1;
+	}
+	if ((f = fopen(file, "wb")) == NULL) {
+		printf(_("writing image '%s' failed\n"), file);
+		gdImageDestroy(im);
+		return -1;
+	}
+	gdImagePng(im, f);
+	fclose(f);
+	gdImageDestroy(im);
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Find out the difference in pixels between a "normal" char and one
+	that goes below the font baseline
+   -------------------------------------------------------------------- */
+int get_baselineoffset(char *text, char *font, int fsz)
+{
+	struct text_metrics o, g;
+
+	if (strpbrk(text, "QgjpqyQµ") == NULL) {	/* if we have none of these */
+		return 0;		/* we don't need an baseline offset */
+	}				/* else we need to calculate it */
+	if ((text_measure(font, fsz, "o", &o) != 0) || (text_measure(font, fsz, "g", &g) != 0)) {
+		return 0;
+	}
+	return g.height - o.height;
+}
+
+pt_bitmap render_text(char *font, int size, char *line[], int lines, int tape_width)
+{
+	struct text_metrics m[MAX_LINES];
+	int i, x=0, fsz=0;
+	char *p;
+	pt_bitmap bm;
+	double t=stats_now();
+
+	if (debug) {
+		printf(_("render_text(): %i lines, font = '%s'\n"), lines, font);
+	}
+	if (gdFTUseFontConfig(1) != GD_TRUE) {
+		printf(_("warning: font config not available\n"));
+	}
+	if (size > 0) {
+		fsz=size;
+		printf(_("setting font size=%i\n"), fsz);
+	} else {
+		if ((fsz=text_fit_size(font, line, lines, tape_width/lines)) < 0) {
+			printf(_("could not estimate needed font size\n"));
+			return NULL;
+		}
+		printf(_("choosing font size=%i\n"), fsz);
+	}
+	/* one measurement per line gives width and height, and is usually
+	   already cached from choosing the font size */
+	int max_height=0;
+	for (i=0; i<lines; i++) {
+		if (text_measure(font, fsz, line[i], &m[i]) != 0) {
+			printf(_("could not measure text '%s'\n"), line[i]);
+			return NULL;
+		}
+		if (m[i].width > x) {
+			x=m[i].width;
+		}
+		if (m[i].height > max_height) {
+			max_height=m[i].height;
+		}
+	}
+	stats_add(STATS_FONT, t);
+	if (debug) {
+		printf("debug: needed (max) height is %ipx\n", max_height);
+	}
+	/* extra space at the end of the label in pixels - 32 to accommodate the text on tapes, and 32 for actual
+	 * padding */
+	int padding = 64;
+	if ((bm=ptouch_bitmap_new(x + padding, tape_width)) == NULL) {
+		return NULL;
+	}
+	/* now render lines */
+	for (i=0; i<lines; i++) {
+		int ofs=get_baselineoffset(line[i], font, fsz);
+		int pos=((i)*(tape_width/(lines)))+(max_height)-ofs-1;
+		if (debug) {
+			printf("debug: line %i pos=%i ofs=%i\n", i+1, pos, ofs);
+		}
+		if ((p=text_render(bm, font, fsz, 0, pos, line[i])) != NULL) {
+			printf(_("error in gdImageStringFT: %s\n"), p);
+		}
+	}
+	return bm;
+}
+
+pt_bitmap img_cutmark(int tape_width)
+{
+	pt_bitmap out=NULL;
+
+	out=ptouch_bitmap_new(9, tape_width);
+	if (out == NULL) {
+		return NULL;
+	}
+	/* dashed line in column 5, 3px gap then 3px black */
+	for (int y=3; y<tape_width; y+=6) {
+		ptouch_bitmap_fill(out, 5, y, 1, 3, 1);
+	}
+	return out;
+}
+
+pt_bitmap img_padding(int tape_width, int length)
+{
+	if ((length < 1) || (length > 256)) {
+		length=1;
+	}
+	return ptouch_bitmap_new(length, tape_width);
+}
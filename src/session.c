@@ -0,0 +1,207 @@
+/*
+	libptouch - functions to help accessing a brother ptouch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef USING_CMAKE
+#include "config.h"
+#endif
+
+#include <stdio.h>	/* fprintf() */
+#include <stdlib.h>	/* calloc(), free() */
+#include "gettext.h"	/* dgettext() */
+#include "ptouch.h"
+
+#define _(s) dgettext(PACKAGE, s)
+
+/* --------------------------------------------------------------------
+	Sessions and jobs: a program that prints many labels opens the
+	printer once and keeps the session, every label is a job that
+	is begun, fed raster columns or bitmaps and ended with a cut or
+	chained to the next one.
+   -------------------------------------------------------------------- */
+struct _pt_session {
+	ptouch_dev ptdev;
+	int tape_width;		/* px, as of the last status */
+};
+
+struct _pt_job {
+	pt_session s;
+	uint8_t *line;		/* one raster line */
+	int lines;		/* raster lines sent so far */
+	int error;
+};
+
+/* take over a device opened with one of the ptouch_open functions */
+pt_session ptouch_session_new(ptouch_dev ptdev)
+{
+	pt_session s;
+
+	if ((s=calloc(1, sizeof(*s))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		ptouch_close(ptdev);
+		return NULL;
+	}
+	s->ptdev=ptdev;
+	if (ptouch_init(ptdev) != 0) {
+		fprintf(stderr, _("ptouch_init() failed\n"));
+		ptouch_session_close(s);
+		return NULL;
+	}
+	if (ptouch_session_refresh(s) != 0) {
+		ptouch_session_close(s);
+		return NULL;
+	}
+	return s;
+}
+
+pt_session ptouch_session_open(pt_selector sel)
+{
+	ptouch_dev ptdev;
+
+	if (ptouch_open_sel(&ptdev, sel) != 0) {
+		return NULL;
+	}
+	return ptouch_session_new(ptdev);
+}
+
+/* ask the printer for its status again, e.g. after the tape changed */
+int ptouch_session_refresh(pt_session s)
+{
+	if (ptouch_getstatus(s->ptdev) != 0) {
+		fprintf(stderr, _("ptouch_getstatus() failed\n"));
+		return -1;
+	}
+	s->tape_width=ptouch_get_tape_pixel_width(s->ptdev);
+	return 0;
+}
+
+ptouch_dev ptouch_session_dev(pt_session s)
+{
+	return s->ptdev;
+}
+
+int ptouch_session_tape_width(pt_session s)
+{
+	return s->tape_width;
+}
+
+void ptouch_session_close(pt_session s)
+{
+	if (s == NULL) {
+		return;
+	}
+	ptouch_close(s->ptdev);
+	free(s);
+}
+
+pt_job ptouch_job_begin(pt_session s, uint8_t page_flags)
+{
+	ptouch_dev ptdev=s->ptdev;
+	pt_job j;
+
+	if ((j=calloc(1, sizeof(*j))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		return NULL;
+	}
+	if ((j->line=malloc(ptdev->devinfo->bytes_per_line)) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		free(j);
+		return NULL;
+	}
+	j->s=s;
+	if ((ptdev->devinfo->flags & FLAG_RASTER_PACKBITS) == FLAG_RASTER_PACKBITS) {
+		ptouch_enable_packbits(ptdev);
+	}
+	if (ptouch_rasterstart(ptdev) != 0) {
+		fprintf(stderr, _("ptouch_rasterstart() failed\n"));
+		free(j->line);
+		free(j);
+		return NULL;
+	}
+	/* without the monitor errors are only noticed at the end */
+	ptouch_monitor_start(ptdev);
+	ptouch_page_flags(ptdev, page_flags);
+	return j;
+}
+
+/* n raster columns of bytes_per_line bytes each */
+int ptouch_job_add_columns(pt_job j, const uint8_t *lines, int n)
+{
+	size_t bpl=j->s->ptdev->devinfo->bytes_per_line;
+
+	for (int i=0; (i<n) && (j->error == 0); i++) {
+		if (ptouch_sendraster(j->s->ptdev, (uint8_t *)lines + (size_t)i * bpl, bpl) != 0) {
+			j->error=-1;
+			break;
+		}
+		j->lines++;
+	}
+	return j->error;
+}
+
+/* a bitmap, centered on the tape like ptouch-print does */
+int ptouch_job_add_bitmap(pt_job j, pt_bitmap bm)
+{
+	ptouch_dev ptdev=j->s->ptdev;
+	size_t bpl=ptdev->devinfo->bytes_per_line;
+	int offset;
+
+	if (bm->height > j->s->tape_width) {
+		fprintf(stderr, _("image is too high (%ipx)\n"), bm->height);
+		j->error=-1;
+		return -1;
+	}
+	offset=((int)ptouch_get_max_pixel_width(ptdev) / 2) - (bm->height / 2);
+	for (int x=0; (x<bm->width) && (j->error == 0); x++) {
+		if ((ptouch_bitmap_rasterline(bm, x, j->line, bpl, offset) != 0)
+			|| (ptouch_job_add_columns(j, j->line, 1) != 0)) {
+			j->error=-1;
+		}
+	}
+	return j->error;
+}
+
+/* how many raster lines went to the printer */
+int ptouch_job_lines(pt_job j)
+{
+	return j->lines;
+}
+
+/* PT_JOB_CUT ejects the label, PT_JOB_CHAIN prints it and leaves the
+   tape where it is for the next job */
+int ptouch_job_end(pt_job j, int how)
+{
+	ptouch_dev ptdev=j->s->ptdev;
+	int r=j->error;
+
+	if (r != 0) {
+		ptouch_monitor_stop(ptdev);
+		ptouch_reset(ptdev);
+	} else if (how == PT_JOB_CUT) {
+		r=ptouch_eject(ptdev);
+	} else {
+		if ((ptouch_ff(ptdev) != 0) || (ptouch_flush(ptdev) != 0)) {
+			r=-1;
+		}
+		ptouch_monitor_stop(ptdev);
+	}
+	if ((r != 0) && (ptouch_monitor_error(ptdev) > 0)) {
+		fprintf(stderr, _("printer reported error %04x\n"), ptouch_monitor_error(ptdev));
+	}
+	free(j->line);
+	free(j);
+	return r;
+}
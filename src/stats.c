@@ -0,0 +1,163 @@
+/*
+	ptouch-print - Print labels with images or text on a Brother P-Touch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#define _POSIX_C_SOURCE	199309L	/* needed for clock_gettime() when using -std=c11 */
+
+#ifndef USING_CMAKE
+#include "config.h"
+#endif
+
+#include <stdio.h>	/* fprintf() */
+#include <stdlib.h>	/* realloc() */
+#include <stdbool.h>
+#include <time.h>	/* clock_gettime() */
+#include <pthread.h>
+#include "gettext.h"	/* gettext(), ngettext() */
+#include "ptouch.h"
+#include "stats.h"
+
+#define _(s) gettext(s)
+
+/* --------------------------------------------------------------------
+	Timing for --stats. Segments are rendered on several threads, so
+	everything is added up under a lock. While stats are not enabled
+	stats_now() returns 0 and nothing is recorded.
+   -------------------------------------------------------------------- */
+struct stats_seg {
+	const char *kind;
+	int width;
+	double seconds;
+};
+
+static const char *phase_name[STATS_PHASES]={ "open", "init", "status", "font", "render", "raster", "send" };
+
+static pthread_mutex_t stats_lock=PTHREAD_MUTEX_INITIALIZER;
+static bool stats_on=false;
+static double stats_start;
+static double phase[STATS_PHASES];
+static struct stats_seg *segs;
+static int nsegs, segs_alloc;
+static long lines;
+static size_t payload;		/* raster bytes before encoding */
+
+static double clock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void stats_enable(void)
+{
+	stats_on=true;
+	stats_start=clock_now();
+}
+
+double stats_now(void)
+{
+	return stats_on ? clock_now() : 0;
+}
+
+void stats_add(enum stats_phase ph, double since)
+{
+	double t;
+
+	if (!stats_on) {
+		return;
+	}
+	t=clock_now() - since;
+	pthread_mutex_lock(&stats_lock);
+	phase[ph]+=t;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* one rendered segment, its time also counts for STATS_RENDER */
+void stats_segment(const char *kind, int width, double since)
+{
+	struct stats_seg *tmp;
+	double t;
+
+	if (!stats_on) {
+		return;
+	}
+	t=clock_now() - since;
+	pthread_mutex_lock(&stats_lock);
+	phase[STATS_RENDER]+=t;
+	if (nsegs == segs_alloc) {
+		int n=segs_alloc ? segs_alloc * 2 : 16;
+		if ((tmp=realloc(segs, (size_t)n * sizeof(*segs))) == NULL) {
+			pthread_mutex_unlock(&stats_lock);
+			return;
+		}
+		segs=tmp;
+		segs_alloc=n;
+	}
+	segs[nsegs].kind=kind;
+	segs[nsegs].width=width;
+	segs[nsegs].seconds=t;
+	nsegs++;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_lines(int n, size_t bytes)
+{
+	if (!stats_on) {
+		return;
+	}
+	pthread_mutex_lock(&stats_lock);
+	lines+=n;
+	payload+=bytes;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* xs holds the transfer statistics of all printers added up */
+void stats_report(FILE *f, const struct _pt_xfer_stats *xs, bool json)
+{
+	/* elapsed time, the phases are added up over threads and can be more */
+	double total=clock_now() - stats_start;
+	double ratio=(xs->bytes > 0) ? (double)payload / (double)xs->bytes : 0;
+	double rate=(phase[STATS_SEND] > 0) ? (double)xs->bytes / phase[STATS_SEND] : 0;
+	int i;
+
+	pthread_mutex_lock(&stats_lock);
+	if (json) {
+		fprintf(f, "{\n  \"total\": %.6f,\n  \"phases\": {", total);
+		for (i=0; i<STATS_PHASES; i++) {
+			fprintf(f, "%s\"%s\": %.6f", (i > 0) ? ", " : "", phase_name[i], phase[i]);
+		}
+		fprintf(f, "},\n  \"segments\": [");
+		for (i=0; i<nsegs; i++) {
+			fprintf(f, "%s\n    {\"kind\": \"%s\", \"width\": %i, \"seconds\": %.6f}",
+				(i > 0) ? "," : "", segs[i].kind, segs[i].width, segs[i].seconds);
+		}
+		fprintf(f, "%s],\n  \"raster_lines\": %li,\n  \"payload_bytes\": %zu,\n  \"wire_bytes\": %zu,\n"
+			"  \"compression\": %.3f,\n  \"commands\": %lu,\n  \"transfers\": %lu,\n  \"bytes_per_s\": %.0f\n}\n",
+			(nsegs > 0) ? "\n  " : "", lines, payload, xs->bytes, ratio, xs->commands, xs->completed, rate);
+	} else {
+		fprintf(f, _("total %.3f s\n"), total);
+		for (i=0; i<STATS_PHASES; i++) {
+			fprintf(f, "  %-8s %10.3f ms\n", phase_name[i], phase[i] * 1000);
+		}
+		for (i=0; i<nsegs; i++) {
+			fprintf(f, _("  segment %i (%s, %ipx): %.3f ms\n"), i + 1, segs[i].kind, segs[i].width, segs[i].seconds * 1000);
+		}
+		fprintf(f, _("%li raster lines, %zu bytes of raster data, %zu bytes sent (%.2fx)\n"), lines, payload, xs->bytes, ratio);
+		fprintf(f, _("%lu commands in %lu transfers, %.0f bytes/s\n"), xs->commands, xs->completed, rate);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
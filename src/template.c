@@ -0,0 +1,160 @@
+/*
+	ptouch-print - Print labels with images or text on a Brother P-Touch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef USING_CMAKE
+#include "config.h"
+#endif
+
+#include <stdio.h>	/* printf() */
+#include <stdlib.h>	/* malloc(), realloc() */
+#include <string.h>	/* strncmp(), strlen() */
+#include "gettext.h"	/* gettext(), ngettext() */
+#include "template.h"
+
+#define _(s) gettext(s)
+
+/* --------------------------------------------------------------------
+	Split a line of a CSV file into its fields: fields are separated
+	by commas, "..." quotes and "" within quotes is a quote. Quoted
+	fields can not span lines. Works in place. Returns the number of
+	fields, or -1 on unbalanced quotes.
+   -------------------------------------------------------------------- */
+int csv_split(char *line, char ***fields)
+{
+	char *in=line, *out=line, **f=NULL, **tmp;
+	int n=0, allocated=0;
+
+	line[strcspn(line, "\r\n")]='\0';
+	for (;;) {
+		if (n + 1 >= allocated) {
+			allocated=(allocated > 0) ? allocated * 2 : 16;
+			if ((tmp=realloc(f, (size_t)allocated * sizeof(*f))) == NULL) {
+				free(f);
+				return -1;
+			}
+			f=tmp;
+		}
+		f[n++]=out;
+		if (*in == '"') {
+			in++;
+			for (;;) {
+				if (*in == '\0') {
+					free(f);
+					return -1;
+				}
+				if (*in == '"') {
+					if (in[1] != '"') {
+						in++;
+						break;
+					}
+					in++;
+				}
+				*out++=*in++;
+			}
+		}
+		while ((*in != '\0') && (*in != ',')) {
+			*out++=*in++;
+		}
+		/* out can be where in is, look at the separator first */
+		if (*in == '\0') {
+			*out='\0';
+			break;
+		}
+		in++;
+		*out++='\0';
+	}
+	f[n]=NULL;
+	*fields=f;
+	return n;
+}
+
+/* the field of the slot at s, which points behind the '{' */
+static int template_slot(const char *s, char **names, int n)
+{
+	const char *end=strchr(s, '}');
+
+	if (end == NULL) {
+		return -1;
+	}
+	for (int i=0; i<n; i++) {
+		if ((strncmp(s, names[i], (size_t)(end - s)) == 0) && (names[i][end - s] == '\0')) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* --------------------------------------------------------------------
+	Slots in the text of a template are written {name}, name being one
+	of the column names of the CSV file. {{ is a literal {, and so is
+	a { that is never closed.
+	Returns the number of slots in s, or -1 if one names no column.
+   -------------------------------------------------------------------- */
+int template_fields(const char *s, char **names, int n)
+{
+	int slots=0;
+
+	for (; *s != '\0'; s++) {
+		if (*s != '{') {
+			continue;
+		}
+		if (s[1] == '{') {
+			s++;
+		} else if (strchr(s, '}') != NULL) {
+			if (template_slot(s + 1, names, n) < 0) {
+				printf(_("no column for '%.*s'\n"), (int)(strchr(s, '}') - s + 1), s);
+				return -1;
+			}
+			slots++;
+			s=strchr(s, '}');
+		}
+	}
+	return slots;
+}
+
+/* s with its slots replaced by the values of a record, NULL if out of
+   memory. s must have passed template_fields(). */
+char *template_expand(const char *s, char **names, char **values, int n)
+{
+	size_t len=strlen(s) + 1, o=0;
+	const char *v;
+	char *out;
+	int k;
+
+	for (const char *p=s; *p != '\0'; p++) {
+		if ((*p == '{') && (p[1] != '{') && ((k=template_slot(p + 1, names, n)) >= 0)) {
+			len+=strlen(values[k]);
+		}
+	}
+	if ((out=malloc(len)) == NULL) {
+		return NULL;
+	}
+	for (; *s != '\0'; s++) {
+		if ((*s == '{') && (s[1] == '{')) {
+			out[o++]=*s++;
+		} else if ((*s == '{') && ((k=template_slot(s + 1, names, n)) >= 0)) {
+			for (v=values[k]; *v != '\0'; v++) {
+				out[o++]=*v;
+			}
+			s=strchr(s, '}');
+		} else {
+			out[o++]=*s;
+		}
+	}
+	out[o]='\0';
+	return out;
+}
@@ -0,0 +1,953 @@
+/*
+	ptouch-print - text measurement with memoized FreeType metrics
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#define _POSIX_C_SOURCE	200809L	/* needed for mkstemp() and st_mtim when using -std=c11 */
+
+#include <stdint.h>
+#include <stdio.h>	/* fopen(), fwrite(), rename() */
+#include <stdlib.h>	/* malloc(), free(), mkstemp() */
+#include <string.h>	/* strcmp(), strlen(), memcpy() */
+#include <fcntl.h>	/* open() */
+#include <unistd.h>	/* close(), unlink() */
+#include <sys/mman.h>	/* mmap(), munmap() */
+#include <sys/stat.h>	/* stat() */
+#include <pthread.h>
+#include <gd.h>
+#include "ptouch.h"
+#include "text.h"
+
+#define TEXT_CACHE_BUCKETS	256
+#define TEXT_MIN_SIZE		4
+#define TEXT_MAX_SIZE		4096
+#define TEXT_CACHE_MAX		65536	/* metrics kept in the cache file */
+#define TEXT_GLYPH_BUCKETS	1024
+
+/* a font name as given on the command line, and the file it resolved to */
+struct text_font {
+	struct text_font *next;
+	char *name;
+	char *path;		/* NULL until resolved */
+	int64_t mtime;
+	int64_t fsize;
+	int disk;		/* index in the cache file, -1 if not there or stale */
+	uint32_t out;		/* index in the file being written */
+};
+
+struct text_entry {
+	struct text_entry *next;
+	uint32_t hash;
+	int size;
+	int stored;		/* already in the cache file */
+	struct text_font *font;
+	struct text_metrics m;
+	char *text;
+};
+
+/* Cache file layout, in host byte order: header, fonts, metrics sorted by
+   hash, then a pool of NUL terminated strings the records point into.
+   Every part is a multiple of 8 bytes so the file can be used in place. */
+#define FONTCACHE_MAGIC		"PTFC"
+#define FONTCACHE_VERSION	1
+
+struct fc_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t nfont;
+	uint32_t nmetric;
+	uint32_t pool;
+	uint32_t reserved;
+};
+
+struct fc_font {
+	uint32_t name;
+	uint32_t path;
+	int64_t mtime;
+	int64_t fsize;
+};
+
+struct fc_metric {
+	uint32_t hash;		/* of path, size and text */
+	uint32_t font;
+	int32_t size;
+	uint32_t text;
+	int32_t width;
+	int32_t height;
+	int32_t ascent;
+	int32_t descent;
+};
+
+/* Guards the caches below, so segments can be rendered from several
+   threads. It is never held while gd renders. Entries are not freed
+   before text_cache_clear(), so a pointer into a cache stays valid
+   after the lock is dropped. */
+static pthread_mutex_t text_lock=PTHREAD_MUTEX_INITIALIZER;
+static struct text_entry *text_cache[TEXT_CACHE_BUCKETS];
+static struct text_font *text_fonts;
+static int text_dirty;
+
+static struct {
+	char *file;
+	void *map;
+	size_t len;
+	const struct fc_header *hdr;
+	const struct fc_font *font;
+	const struct fc_metric *metric;
+	const char *pool;
+} fc;
+
+/* FNV-1a */
+static uint32_t text_hash(const char *font, int size, const char *text)
+{
+	uint32_t h=2166136261u;
+
+	for (const char *p=font; *p; p++) {
+		h=(h ^ (uint8_t)*p) * 16777619u;
+	}
+	for (int i=0; i<4; i++) {
+		h=(h ^ (uint8_t)(size >> (8 * i))) * 16777619u;
+	}
+	for (const char *p=text; *p; p++) {
+		h=(h ^ (uint8_t)*p) * 16777619u;
+	}
+	return h;
+}
+
+static const char *fc_string(uint32_t off)
+{
+	return (off < fc.hdr->pool) ? fc.pool + off : NULL;
+}
+
+/* Map a cache file written by text_cache_save(). A missing or unusable
+   file is not an error, it is just replaced on the next save. */
+int text_cache_open(const char *file)
+{
+	struct stat st;
+	const struct fc_header *hdr;
+	uint64_t need;
+	int fd;
+
+	if ((fc.file=strdup(file)) == NULL) {
+		return -1;
+	}
+	if ((fd=open(file, O_RDONLY)) < 0) {
+		return 0;
+	}
+	if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(struct fc_header))) {
+		close(fd);
+		return 0;
+	}
+	fc.map=mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (fc.map == MAP_FAILED) {
+		fc.map=NULL;
+		return 0;
+	}
+	fc.len=(size_t)st.st_size;
+	hdr=fc.map;
+	need=sizeof(*hdr) + (uint64_t)hdr->nfont * sizeof(struct fc_font)
+		+ (uint64_t)hdr->nmetric * sizeof(struct fc_metric) + hdr->pool;
+	if ((memcmp(hdr->magic, FONTCACHE_MAGIC, 4) != 0) || (hdr->version != FONTCACHE_VERSION)
+		|| (need != fc.len) || (hdr->pool == 0)
+		|| (((const char *)fc.map)[fc.len - 1] != '\0')) {
+		munmap(fc.map, fc.len);
+		fc.map=NULL;
+		return 0;
+	}
+	fc.hdr=hdr;
+	fc.font=(const struct fc_font *)(hdr + 1);
+	fc.metric=(const struct fc_metric *)(fc.font + hdr->nfont);
+	fc.pool=(const char *)(fc.metric + hdr->nmetric);
+	return 0;
+}
+
+static int text_font_stat(struct text_font *f)
+{
+	struct stat st;
+
+	if (stat(f->path, &st) != 0) {
+		return -1;
+	}
+	f->mtime=(int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	f->fsize=(int64_t)st.st_size;
+	return 0;
+}
+
+/* the font entry for name, checked against the cache file when first
+   used, text_lock must be held */
+static struct text_font *text_font_get(const char *name)
+{
+	struct text_font *f;
+
+	for (f=text_fonts; f; f=f->next) {
+		if (strcmp(f->name, name) == 0) {
+			return f;
+		}
+	}
+	if ((f=calloc(1, sizeof(*f))) == NULL) {
+		return NULL;
+	}
+	if ((f->name=strdup(name)) == NULL) {
+		free(f);
+		return NULL;
+	}
+	f->disk=-1;
+	for (uint32_t i=0; (fc.hdr != NULL) && (i < fc.hdr->nfont); i++) {
+		const char *n=fc_string(fc.font[i].name), *p=fc_string(fc.font[i].path);
+		if ((n == NULL) || (p == NULL) || (strcmp(n, name) != 0)) {
+			continue;
+		}
+		if ((f->path=strdup(p)) == NULL) {
+			break;
+		}
+		if ((text_font_stat(f) == 0) && (f->mtime == fc.font[i].mtime) && (f->fsize == fc.font[i].fsize)) {
+			f->disk=(int)i;
+		} else {
+			/* the font changed since it was measured, resolve it again */
+			free(f->path);
+			f->path=NULL;
+		}
+		break;
+	}
+	f->next=text_fonts;
+	text_fonts=f;
+	return f;
+}
+
+static int fc_lookup(struct text_font *f, int size, const char *text, struct text_metrics *m)
+{
+	uint32_t h=text_hash(f->path, size, text);
+	uint32_t lo=0, hi=fc.hdr->nmetric;
+
+	while (lo < hi) {
+		uint32_t mid=lo + (hi - lo) / 2;
+		if (fc.metric[mid].hash < h) {
+			lo=mid + 1;
+		} else {
+			hi=mid;
+		}
+	}
+	for (; (lo < fc.hdr->nmetric) && (fc.metric[lo].hash == h); lo++) {
+		const struct fc_metric *r=&fc.metric[lo];
+		const char *t=fc_string(r->text);
+		if ((r->font == (uint32_t)f->disk) && (r->size == size) && (t != NULL) && (strcmp(t, text) == 0)) {
+			m->width=r->width;
+			m->height=r->height;
+			m->ascent=r->ascent;
+			m->descent=r->descent;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static struct text_entry *text_lookup(uint32_t h, const char *font, int size, const char *text)
+{
+	for (struct text_entry *e=text_cache[h % TEXT_CACHE_BUCKETS]; e; e=e->next) {
+		if ((e->hash == h) && (e->size == size) && (strcmp(e->text, text) == 0) && (strcmp(e->font->name, font) == 0)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void text_insert(uint32_t h, struct text_font *f, int size, const char *text, struct text_metrics *m, int stored)
+{
+	size_t tl=strlen(text) + 1;
+	struct text_entry *e;
+
+	/* not being able to cache is not an error */
+	if ((e=malloc(sizeof(*e) + tl)) == NULL) {
+		return;
+	}
+	e->hash=h;
+	e->size=size;
+	e->stored=stored;
+	e->font=f;
+	e->m=*m;
+	e->text=(char *)(e + 1);
+	memcpy(e->text, text, tl);
+	e->next=text_cache[h % TEXT_CACHE_BUCKETS];
+	text_cache[h % TEXT_CACHE_BUCKETS]=e;
+	if (!stored) {
+		text_dirty=1;
+	}
+}
+
+/* Measure text in a single FreeType layout pass. Results are remembered
+   per (font, size, text), and across runs if a cache file is open.
+   Returns -1 if the font can not be used. */
+int text_measure(char *font, int size, char *text, struct text_metrics *m)
+{
+	uint32_t h=text_hash(font, size, text);
+	gdFTStringExtra strex={ 0 };
+	struct text_font *f;
+	struct text_entry *e;
+	char *path=NULL;
+	int brect[8];
+
+	pthread_mutex_lock(&text_lock);
+	if ((e=text_lookup(h, font, size, text)) != NULL) {
+		*m=e->m;
+		pthread_mutex_unlock(&text_lock);
+		return 0;
+	}
+	if ((f=text_font_get(font)) == NULL) {
+		pthread_mutex_unlock(&text_lock);
+		return -1;
+	}
+	if ((f->disk >= 0) && (fc_lookup(f, size, text, m) == 0)) {
+		text_insert(h, f, size, text, m, 1);
+		pthread_mutex_unlock(&text_lock);
+		return 0;
+	}
+	/* the file is needed for the metrics cache and for text_font_file() */
+	if (f->path == NULL) {
+		strex.flags=gdFTEX_RETURNFONTPATHNAME;
+	}
+	pthread_mutex_unlock(&text_lock);
+	if (gdImageStringFTEx(NULL, &brect[0], -1, font, size, 0.0, 0, 0, text, &strex) != NULL) {
+		return -1;
+	}
+	m->width=brect[2]-brect[0];
+	m->height=brect[1]-brect[5];
+	m->ascent=-brect[5];
+	m->descent=brect[1];
+	if (strex.fontpath != NULL) {
+		path=strdup(strex.fontpath);
+		gdFree(strex.fontpath);
+	}
+	pthread_mutex_lock(&text_lock);
+	if ((path != NULL) && (f->path == NULL)) {
+		f->path=path;
+		if (text_font_stat(f) != 0) {
+			f->path=NULL;
+		} else {
+			path=NULL;
+		}
+	}
+	/* another thread may have measured the same text meanwhile */
+	if (text_lookup(h, font, size, text) == NULL) {
+		text_insert(h, f, size, text, m, 0);
+	}
+	pthread_mutex_unlock(&text_lock);
+	free(path);
+	return 0;
+}
+
+/* The file font resolves to and its modification time, e.g. for keys of
+   cached output that has to change when the font does. *path stays
+   valid until text_cache_clear(). Returns -1 if it can not be found. */
+int text_font_file(char *font, const char **path, int64_t *mtime)
+{
+	struct text_metrics m;
+	struct text_font *f;
+	int r=-1;
+
+	/* measuring resolves the font if that did not happen yet */
+	if (text_measure(font, 12, "o", &m) != 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&text_lock);
+	if (((f=text_font_get(font)) != NULL) && (f->path != NULL)) {
+		*path=f->path;
+		*mtime=f->mtime;
+		r=0;
+	}
+	pthread_mutex_unlock(&text_lock);
+	return r;
+}
+
+/* 1 if all lines are at most want_px high at size, 0 if not, -1 on errors */
+static int text_fits(char *font, char *line[], int lines, int size, int want_px)
+{
+	struct text_metrics m;
+
+	for (int i=0; i<lines; i++) {
+		if (text_measure(font, size, line[i], &m) != 0) {
+			return -1;
+		}
+		if (m.height > want_px) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* --------------------------------------------------------------------
+	Find the largest font size at which every line is at most want_px
+	pixels high. Text grows with the font size, so the size is found
+	by doubling and then bisecting, which takes a handful of
+	measurements instead of one per size step.
+	Returns -1 if even the smallest size does not fit.
+   -------------------------------------------------------------------- */
+int text_fit_size(char *font, char *line[], int lines, int want_px)
+{
+	int lo=TEXT_MIN_SIZE, hi, r;
+
+	if (text_fits(font, line, lines, lo, want_px) != 1) {
+		return -1;
+	}
+	for (hi=lo * 2; ; hi*=2) {
+		if (hi > TEXT_MAX_SIZE) {
+			return lo;
+		}
+		if ((r=text_fits(font, line, lines, hi, want_px)) < 0) {
+			return -1;
+		}
+		if (r == 0) {
+			break;
+		}
+		lo=hi;
+	}
+	/* lo fits, hi does not */
+	while (hi - lo > 1) {
+		int mid=lo + (hi - lo) / 2;
+		if ((r=text_fits(font, line, lines, mid, want_px)) < 0) {
+			return -1;
+		}
+		if (r == 1) {
+			lo=mid;
+		} else {
+			hi=mid;
+		}
+	}
+	return lo;
+}
+
+/* gdImageStringFTEx() on the resolved font file if it is known, so
+   fontconfig is only asked once per font */
+static char *text_ftex(gdImage *im, int *brect, int fg, struct text_font *f, int size, int x, int y, char *text, gdFTStringExtra *strex)
+{
+	char *path;
+
+	/* the path is set once and kept until text_cache_clear() */
+	pthread_mutex_lock(&text_lock);
+	path=f->path;
+	pthread_mutex_unlock(&text_lock);
+	if (path == NULL) {
+		return gdImageStringFTEx(im, brect, fg, f->name, size, 0.0, x, y, text, strex);
+	}
+	strex->flags|=gdFTEX_FONTPATHNAME;
+	return gdImageStringFTEx(im, brect, fg, path, size, 0.0, x, y, text, strex);
+}
+
+/* Rasterize text without antialiasing. The bitmap's top left pixel is at
+   (*left, *top) relative to the origin of the baseline. */
+static pt_bitmap text_rasterize(struct text_font *f, int size, char *text, int *left, int *top, char **err)
+{
+	gdFTStringExtra strex={ 0 };
+	gdImage *im;
+	pt_bitmap bm;
+	int brect[8], w, h, black;
+
+	if ((*err=text_ftex(NULL, &brect[0], -1, f, size, 0, 0, text, &strex)) != NULL) {
+		return NULL;
+	}
+	/* one pixel of slack around the bounding box gd reports */
+	*left=brect[0] - 1;
+	*top=brect[5] - 1;
+	w=brect[2] - brect[0] + 3;
+	h=brect[1] - brect[5] + 3;
+	if ((im=gdImageCreatePalette(w, h)) == NULL) {
+		*err="out of memory";
+		return NULL;
+	}
+	gdImageColorAllocate(im, 255, 255, 255);
+	black=gdImageColorAllocate(im, 0, 0, 0);
+	strex.flags=0;
+	if ((*err=text_ftex(im, &brect[0], -black, f, size, -*left, -*top, text, &strex)) != NULL) {
+		gdImageDestroy(im);
+		return NULL;
+	}
+	if ((bm=ptouch_bitmap_new(w, h)) == NULL) {
+		gdImageDestroy(im);
+		*err="out of memory";
+		return NULL;
+	}
+	for (int y=0; y<h; y++) {
+		for (int x=0; x<w; x++) {
+			if (gdImageGetPixel(im, x, y) == black) {
+				ptouch_bitmap_set(bm, x, y, 1);
+			}
+		}
+	}
+	gdImageDestroy(im);
+	return bm;
+}
+
+/* decode one UTF-8 character, returns its length or 0 if s is not valid */
+static int utf8_decode(const char *s, uint32_t *cp)
+{
+	const uint8_t *p=(const uint8_t *)s;
+	int n;
+
+	if (p[0] < 0x80) {
+		*cp=p[0];
+		return 1;
+	} else if ((p[0] & 0xe0) == 0xc0) {
+		*cp=p[0] & 0x1f;
+		n=2;
+	} else if ((p[0] & 0xf0) == 0xe0) {
+		*cp=p[0] & 0x0f;
+		n=3;
+	} else if ((p[0] & 0xf8) == 0xf0) {
+		*cp=p[0] & 0x07;
+		n=4;
+	} else {
+		return 0;
+	}
+	for (int i=1; i<n; i++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+		*cp=(*cp << 6) | (p[i] & 0x3f);
+	}
+	return n;
+}
+
+/* Characters that are laid out one after the other without shaping, so
+   a line can be composed from separately rendered glyphs. Anything else
+   (combining marks, right to left and Indic scripts, bidi controls, ...)
+   goes through FreeType as a whole line. */
+static int text_simple_char(uint32_t cp)
+{
+	if ((cp == '&') || (cp < 0x20)) {
+		return 0;	/* gd expands &#123; entities */
+	}
+	return (cp < 0x300)
+		|| ((cp >= 0x370) && (cp < 0x590))		/* Greek, Cyrillic, Armenian */
+		|| ((cp >= 0x1e00) && (cp < 0x2000))		/* Latin and Greek extended */
+		|| ((cp >= 0x2010) && (cp < 0x2028))		/* dashes, quotes, bullets */
+		|| ((cp >= 0x2030) && (cp < 0x2060))
+		|| ((cp >= 0x2070) && (cp < 0x2c00))		/* symbols, arrows, shapes */
+		|| ((cp >= 0x3000) && (cp < 0xa000))		/* CJK */
+		|| ((cp >= 0xac00) && (cp < 0xd7a4))		/* Hangul syllables */
+		|| ((cp >= 0xff00) && (cp < 0xfff0));		/* full width forms */
+}
+
+struct text_glyph {
+	struct text_glyph *next;
+	struct text_font *font;
+	int size;
+	uint32_t cp;
+	pt_bitmap bm;
+	int left;
+	int top;
+};
+
+/* distance from the origin of glyph a to that of glyph b, kerning included */
+struct text_pair {
+	struct text_pair *next;
+	struct text_font *font;
+	int size;
+	uint32_t a, b;
+	double advance;
+};
+
+static struct text_glyph *glyph_cache[TEXT_GLYPH_BUCKETS];
+static struct text_pair *pair_cache[TEXT_GLYPH_BUCKETS];
+
+static unsigned glyph_bucket(struct text_font *f, int size, uint32_t a, uint32_t b)
+{
+	uintptr_t h=(uintptr_t)f ^ ((uintptr_t)size * 2654435761u) ^ (a * 40503u) ^ (b * 2246822519u);
+
+	return (unsigned)((h ^ (h >> 13)) % TEXT_GLYPH_BUCKETS);
+}
+
+static struct text_glyph *glyph_find(unsigned b, struct text_font *f, int size, uint32_t cp)
+{
+	for (struct text_glyph *g=glyph_cache[b]; g; g=g->next) {
+		if ((g->font == f) && (g->size == size) && (g->cp == cp)) {
+			return g;
+		}
+	}
+	return NULL;
+}
+
+static struct text_glyph *text_glyph(struct text_font *f, int size, const char *s, int len, uint32_t cp, char **err)
+{
+	unsigned b=glyph_bucket(f, size, cp, 0);
+	struct text_glyph *g, *other;
+	char buf[5];
+
+	pthread_mutex_lock(&text_lock);
+	g=glyph_find(b, f, size, cp);
+	pthread_mutex_unlock(&text_lock);
+	if (g != NULL) {
+		return g;
+	}
+	if ((g=malloc(sizeof(*g))) == NULL) {
+		*err="out of memory";
+		return NULL;
+	}
+	memcpy(buf, s, (size_t)len);
+	buf[len]='\0';
+	if ((g->bm=text_rasterize(f, size, buf, &g->left, &g->top, err)) == NULL) {
+		free(g);
+		return NULL;
+	}
+	g->font=f;
+	g->size=size;
+	g->cp=cp;
+	pthread_mutex_lock(&text_lock);
+	/* keep the first one if another thread was quicker */
+	if ((other=glyph_find(b, f, size, cp)) != NULL) {
+		pthread_mutex_unlock(&text_lock);
+		ptouch_bitmap_free(g->bm);
+		free(g);
+		return other;
+	}
+	g->next=glyph_cache[b];
+	glyph_cache[b]=g;
+	pthread_mutex_unlock(&text_lock);
+	return g;
+}
+
+/* how far the pen moves from character a (len_a bytes at s) to the
+   following character b, -1 if gd does not tell */
+static double text_advance(struct text_font *f, int size, const char *s, int len_a, int len_b, uint32_t a, uint32_t b)
+{
+	unsigned h=glyph_bucket(f, size, a, b);
+	gdFTStringExtra strex={ .flags=gdFTEX_XSHOW };
+	struct text_pair *p;
+	char buf[9], *end;
+	int brect[8];
+	double adv=-1;
+
+	pthread_mutex_lock(&text_lock);
+	for (p=pair_cache[h]; p; p=p->next) {
+		if ((p->font == f) && (p->size == size) && (p->a == a) && (p->b == b)) {
+			adv=p->advance;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&text_lock);
+	if (p != NULL) {
+		return adv;
+	}
+	memcpy(buf, s, (size_t)(len_a + len_b));
+	buf[len_a + len_b]='\0';
+	if (text_ftex(NULL, &brect[0], -1, f, size, 0, 0, buf, &strex) != NULL) {
+		return -1;
+	}
+	if (strex.xshow != NULL) {
+		adv=strtod(strex.xshow, &end);
+		if (end == strex.xshow) {
+			adv=-1;
+		}
+		gdFree(strex.xshow);
+	}
+	/* a pair measured twice at the same time is just kept twice */
+	if ((adv >= 0) && ((p=malloc(sizeof(*p))) != NULL)) {
+		p->font=f;
+		p->size=size;
+		p->a=a;
+		p->b=b;
+		p->advance=adv;
+		pthread_mutex_lock(&text_lock);
+		p->next=pair_cache[h];
+		pair_cache[h]=p;
+		pthread_mutex_unlock(&text_lock);
+	}
+	return adv;
+}
+
+/* Compose a line from cached glyphs. Returns 1 if it has to go through
+   FreeType instead, in which case nothing has been drawn yet. */
+static int text_render_glyphs(pt_bitmap bm, struct text_font *f, int size, int x, int y, char *text, char **err)
+{
+	uint32_t cp, next=0;
+	int len, nlen;
+	double pen=x;
+
+	/* check everything first, a line is never drawn half */
+	for (const char *s=text; *s; s+=len) {
+		if (((len=utf8_decode(s, &cp)) == 0) || !text_simple_char(cp)) {
+			return 1;
+		}
+	}
+	for (const char *s=text; *s; s+=len) {
+		len=utf8_decode(s, &cp);
+		if (s[len] == '\0') {
+			break;
+		}
+		nlen=utf8_decode(s + len, &next);
+		if (text_advance(f, size, s, len, nlen, cp, next) < 0) {
+			return 1;
+		}
+	}
+	for (const char *s=text; *s; s+=len) {
+		struct text_glyph *g;
+		len=utf8_decode(s, &cp);
+		if ((g=text_glyph(f, size, s, len, cp, err)) == NULL) {
+			return -1;
+		}
+		ptouch_bitmap_or(bm, (int)(pen + 0.5) + g->left, y + g->top, g->bm);
+		if (s[len] != '\0') {
+			nlen=utf8_decode(s + len, &next);
+			pen+=text_advance(f, size, s, len, nlen, cp, next);
+		}
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Draw text into bm with the origin of its baseline at (x,y).
+	Simple scripts are composed from glyphs that are rasterized once
+	per font, size and character, with the distance between each pair
+	of characters taken from gd so kerning is kept. Everything else
+	is rendered as a whole line by FreeType.
+	Returns NULL or an error message like gdImageStringFT().
+   -------------------------------------------------------------------- */
+char *text_render(struct _pt_bitmap *bm, char *font, int size, int x, int y, char *text)
+{
+	struct text_font *f;
+	pt_bitmap line;
+	char *err=NULL;
+	int left, top;
+
+	pthread_mutex_lock(&text_lock);
+	f=text_font_get(font);
+	pthread_mutex_unlock(&text_lock);
+	if (f == NULL) {
+		return "out of memory";
+	}
+	if (text_render_glyphs(bm, f, size, x, y, text, &err) <= 0) {
+		return err;
+	}
+	if ((line=text_rasterize(f, size, text, &left, &top, &err)) == NULL) {
+		return err;
+	}
+	ptouch_bitmap_or(bm, x + left, y + top, line);
+	ptouch_bitmap_free(line);
+	return NULL;
+}
+
+static int cmp_metric(const void *a, const void *b)
+{
+	uint32_t ha=((const struct fc_metric *)a)->hash, hb=((const struct fc_metric *)b)->hash;
+
+	return (ha > hb) - (ha < hb);
+}
+
+/* append s to the string pool, returns its offset */
+static uint32_t pool_add(char **pool, size_t *len, size_t *alloc, const char *s)
+{
+	size_t l=strlen(s) + 1, off=*len;
+	char *p;
+
+	if (*len + l > *alloc) {
+		size_t n=(*alloc > 0) ? *alloc * 2 : 4096;
+		while (n < *len + l) {
+			n*=2;
+		}
+		if ((p=realloc(*pool, n)) == NULL) {
+			return UINT32_MAX;
+		}
+		*pool=p;
+		*alloc=n;
+	}
+	memcpy(*pool + off, s, l);
+	*len+=l;
+	return (uint32_t)off;
+}
+
+/* --------------------------------------------------------------------
+	Write all metrics measured in this run to the cache file, together
+	with those from the old file whose font did not change. The new
+	file is renamed over the old one, so processes which still have
+	the old one mapped are not disturbed.
+   -------------------------------------------------------------------- */
+int text_cache_save(void)
+{
+	struct fc_header hdr={ .version=FONTCACHE_VERSION };
+	struct fc_font *font=NULL;
+	struct fc_metric *metric=NULL;
+	uint32_t *remap=NULL;
+	char *pool=NULL, *tmp=NULL;
+	size_t plen=0, palloc=0, nf=0, nm=0, maxf=0, maxm=TEXT_CACHE_MAX;
+	uint32_t oldf=(fc.hdr != NULL) ? fc.hdr->nfont : 0;
+	FILE *f=NULL;
+	int fd, rc=-1;
+
+	if ((fc.file == NULL) || !text_dirty) {
+		return 0;
+	}
+	for (struct text_font *t=text_fonts; t; t=t->next) {
+		maxf++;
+	}
+	maxf+=oldf;
+	if (((font=calloc(maxf + 1, sizeof(*font))) == NULL) || ((metric=calloc(maxm, sizeof(*metric))) == NULL)
+		|| ((remap=calloc(oldf + 1, sizeof(*remap))) == NULL)) {
+		goto out;
+	}
+	/* fonts resolved in this run come first, then still valid old ones */
+	for (struct text_font *t=text_fonts; t; t=t->next) {
+		if (t->path == NULL) {
+			continue;
+		}
+		font[nf].name=pool_add(&pool, &plen, &palloc, t->name);
+		font[nf].path=pool_add(&pool, &plen, &palloc, t->path);
+		font[nf].mtime=t->mtime;
+		font[nf].fsize=t->fsize;
+		t->out=(uint32_t)nf++;
+	}
+	for (uint32_t i=0; i<oldf; i++) {
+		struct text_font t={ .path=(char *)fc_string(fc.font[i].path) };
+		const char *name=fc_string(fc.font[i].name);
+		struct text_font *cur;
+		remap[i]=UINT32_MAX;
+		if ((name == NULL) || (t.path == NULL)) {
+			continue;
+		}
+		for (cur=text_fonts; cur; cur=cur->next) {
+			if (strcmp(cur->name, name) == 0) {
+				break;
+			}
+		}
+		if (cur != NULL) {
+			/* seen in this run: either stale or written above */
+			if ((cur->path != NULL) && (strcmp(cur->path, t.path) == 0)
+				&& (cur->mtime == fc.font[i].mtime) && (cur->fsize == fc.font[i].fsize)) {
+				remap[i]=cur->out;
+			}
+			continue;
+		}
+		if ((text_font_stat(&t) != 0) || (t.mtime != fc.font[i].mtime) || (t.fsize != fc.font[i].fsize)) {
+			continue;
+		}
+		font[nf]=fc.font[i];
+		font[nf].name=pool_add(&pool, &plen, &palloc, name);
+		font[nf].path=pool_add(&pool, &plen, &palloc, t.path);
+		remap[i]=(uint32_t)nf++;
+	}
+	/* metrics from this run first, old ones are dropped when the file is full */
+	for (int b=0; b<TEXT_CACHE_BUCKETS; b++) {
+		for (struct text_entry *e=text_cache[b]; e && (nm < maxm); e=e->next) {
+			if (e->stored || (e->font->path == NULL)) {
+				continue;
+			}
+			metric[nm].hash=text_hash(e->font->path, e->size, e->text);
+			metric[nm].font=e->font->out;
+			metric[nm].size=e->size;
+			metric[nm].text=pool_add(&pool, &plen, &palloc, e->text);
+			metric[nm].width=e->m.width;
+			metric[nm].height=e->m.height;
+			metric[nm].ascent=e->m.ascent;
+			metric[nm].descent=e->m.descent;
+			nm++;
+		}
+	}
+	for (uint32_t i=0; (fc.hdr != NULL) && (i < fc.hdr->nmetric) && (nm < maxm); i++) {
+		const char *t;
+		if ((fc.metric[i].font >= oldf) || (remap[fc.metric[i].font] == UINT32_MAX)
+			|| ((t=fc_string(fc.metric[i].text)) == NULL)) {
+			continue;
+		}
+		metric[nm]=fc.metric[i];
+		metric[nm].font=remap[fc.metric[i].font];
+		metric[nm].text=pool_add(&pool, &plen, &palloc, t);
+		nm++;
+	}
+	/* pad the pool, the last byte is always a NUL */
+	while ((plen == 0) || (plen % 8)) {
+		pool_add(&pool, &plen, &palloc, "");
+	}
+	for (size_t i=0; i<nf; i++) {
+		if ((font[i].name == UINT32_MAX) || (font[i].path == UINT32_MAX)) {
+			goto out;
+		}
+	}
+	for (size_t i=0; i<nm; i++) {
+		if (metric[i].text == UINT32_MAX) {
+			goto out;
+		}
+	}
+	qsort(metric, nm, sizeof(*metric), cmp_metric);
+	memcpy(hdr.magic, FONTCACHE_MAGIC, sizeof(hdr.magic));
+	hdr.nfont=(uint32_t)nf;
+	hdr.nmetric=(uint32_t)nm;
+	hdr.pool=(uint32_t)plen;
+	if ((tmp=malloc(strlen(fc.file) + 8)) == NULL) {
+		goto out;
+	}
+	sprintf(tmp, "%s.XXXXXX", fc.file);
+	if ((fd=mkstemp(tmp)) < 0) {
+		goto out;
+	}
+	if ((f=fdopen(fd, "wb")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if ((fwrite(&hdr, sizeof(hdr), 1, f) != 1) || (fwrite(font, sizeof(*font), nf, f) != nf)
+		|| (fwrite(metric, sizeof(*metric), nm, f) != nm) || (fwrite(pool, 1, plen, f) != plen)) {
+		fclose(f);
+		unlink(tmp);
+		goto out;
+	}
+	if ((fclose(f) != 0) || (rename(tmp, fc.file) != 0)) {
+		unlink(tmp);
+		goto out;
+	}
+	text_dirty=0;
+	rc=0;
+out:
+	free(tmp);
+	free(pool);
+	free(remap);
+	free(metric);
+	free(font);
+	return rc;
+}
+
+void text_cache_clear(void)
+{
+	for (int i=0; i<TEXT_GLYPH_BUCKETS; i++) {
+		while (glyph_cache[i] != NULL) {
+			struct text_glyph *g=glyph_cache[i];
+			glyph_cache[i]=g->next;
+			ptouch_bitmap_free(g->bm);
+			free(g);
+		}
+		while (pair_cache[i] != NULL) {
+			struct text_pair *p=pair_cache[i];
+			pair_cache[i]=p->next;
+			free(p);
+		}
+	}
+	for (int i=0; i<TEXT_CACHE_BUCKETS; i++) {
+		while (text_cache[i] != NULL) {
+			struct text_entry *e=text_cache[i];
+			text_cache[i]=e->next;
+			free(e);
+		}
+	}
+	while (text_fonts != NULL) {
+		struct text_font *f=text_fonts;
+		text_fonts=f->next;
+		free(f->name);
+		free(f->path);
+		free(f);
+	}
+	if (fc.map != NULL) {
+		munmap(fc.map, fc.len);
+	}
+	free(fc.file);
+	memset(&fc, 0, sizeof(fc));
+	text_dirty=0;
+}
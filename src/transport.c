@@ -0,0 +1,161 @@
+/*
+	libptouch - functions to help accessing a brother ptouch
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef USING_CMAKE
+#include "config.h"
+#endif
+
+#include <stdio.h>	/* fopen(), fwrite() */
+#include <stdlib.h>	/* calloc(), free() */
+#include <string.h>	/* memcpy(), strerror() */
+#include <errno.h>
+#include "gettext.h"	/* dgettext() */
+#include "ptouch.h"
+
+#define _(s) dgettext(PACKAGE, s)
+
+/* --------------------------------------------------------------------
+	Transports that need no printer: capture writes the exact byte
+	stream a printer would get to a file and answers status requests
+	itself, replay takes the answers from a file of 32 byte status
+	replies as recorded from a real printer.
+   -------------------------------------------------------------------- */
+struct pt_file {
+	FILE *out;		/* capture file, NULL to drop the data */
+	FILE *replies;		/* NULL for the made up status */
+	uint8_t status[32];	/* the made up status reply */
+};
+
+static int file_write(ptouch_dev ptdev, uint8_t *data, size_t len)
+{
+	struct pt_file *f=ptdev->tp;
+
+	if ((f->out != NULL) && (fwrite(data, len, 1, f->out) != 1)) {
+		fprintf(stderr, _("write error: %s\n"), strerror(errno));
+		ptdev->tx_error=-1;
+		return -1;
+	}
+	ptdev->xstats.submitted++;
+	ptdev->xstats.completed++;
+	ptdev->xstats.bytes+=len;
+	return 0;
+}
+
+static int capture_read(ptouch_dev ptdev, uint8_t *buf, size_t len, unsigned int timeout_ms)
+{
+	struct pt_file *f=ptdev->tp;
+
+	(void)timeout_ms;
+	if (len > sizeof(f->status)) {
+		len=sizeof(f->status);
+	}
+	memcpy(buf, f->status, len);
+	return (int)len;
+}
+
+static int replay_read(ptouch_dev ptdev, uint8_t *buf, size_t len, unsigned int timeout_ms)
+{
+	struct pt_file *f=ptdev->tp;
+	size_t n;
+
+	(void)timeout_ms;
+	if ((n=fread(buf, 1, len, f->replies)) == 0) {
+		fprintf(stderr, _("no more status replies to replay\n"));
+		return -1;
+	}
+	return (int)n;
+}
+
+static void file_free(struct pt_file *f)
+{
+	if ((f->out != NULL) && (fclose(f->out) != 0)) {
+		fprintf(stderr, _("write error: %s\n"), strerror(errno));
+	}
+	if (f->replies != NULL) {
+		fclose(f->replies);
+	}
+	free(f);
+}
+
+static void file_close(ptouch_dev ptdev)
+{
+	file_free(ptdev->tp);
+	ptdev->tp=NULL;
+}
+
+static const struct _pt_transport_ops capture_ops={ file_write, capture_read, file_close };
+static const struct _pt_transport_ops replay_ops={ file_write, replay_read, file_close };
+
+static struct pt_file *file_new(const char *file)
+{
+	struct pt_file *f;
+
+	if ((f=calloc(1, sizeof(*f))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		return NULL;
+	}
+	if ((file != NULL) && ((f->out=fopen(file, "wb")) == NULL)) {
+		fprintf(stderr, _("can not open '%s': %s\n"), file, strerror(errno));
+		free(f);
+		return NULL;
+	}
+	return f;
+}
+
+/* a printer pid with a tape_mm wide tape whose output goes to file,
+   or nowhere if file is NULL */
+int ptouch_open_capture(ptouch_dev *ptdev, uint16_t pid, int tape_mm, const char *file)
+{
+	struct pt_file *f;
+
+	if ((f=file_new(file)) == NULL) {
+		return -1;
+	}
+	f->status[0]=0x80;	/* print head mark */
+	f->status[1]=0x20;	/* size */
+	f->status[2]='B';
+	f->status[3]='0';
+	f->status[5]='0';
+	f->status[10]=(uint8_t)tape_mm;
+	f->status[11]=0x01;	/* laminated tape */
+	if (ptouch_open_transport(ptdev, pid, &capture_ops, f) != 0) {
+		file_free(f);
+		return -1;
+	}
+	return 0;
+}
+
+/* a printer pid that answers with the status replies read from replies,
+   its output goes to file as with ptouch_open_capture() */
+int ptouch_open_replay(ptouch_dev *ptdev, uint16_t pid, const char *replies, const char *file)
+{
+	struct pt_file *f;
+
+	if ((f=file_new(file)) == NULL) {
+		return -1;
+	}
+	if ((f->replies=fopen(replies, "rb")) == NULL) {
+		fprintf(stderr, _("can not open '%s': %s\n"), replies, strerror(errno));
+		file_free(f);
+		return -1;
+	}
+	if (ptouch_open_transport(ptdev, pid, &replay_ops, f) != 0) {
+		file_free(f);
+		return -1;
+	}
+	return 0;
+}